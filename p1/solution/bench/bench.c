@@ -0,0 +1,307 @@
+// Benchmark driver for letter-boxed.
+//
+//   bench [-j N] [-n COUNT] LETTER_BOXED CORPUS_DIR
+//
+// For a corpus written by gen-corpus, reports the time and peak RSS of:
+//   building the index, starting up and checking one solution with the
+//   text dictionary and with the index, rejecting the invalid board,
+//   --solve, --serve answering the first COUNT submissions one at a time
+//   (latency percentiles), and --serve -j N streaming every submission
+//   (throughput).
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define LOAD_RUNS 5
+#define DEFAULT_COUNT 20000
+
+typedef struct
+{
+    double seconds;
+    long max_rss_kb;
+    int status;
+} run_result;
+
+static const char* program;
+static const char* corpus;
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char* corpus_path(const char* name)
+{
+    static char paths[8][4096];
+    static int next = 0;
+    char* path = paths[next++ % 8];
+    snprintf(path, sizeof(paths[0]), "%s/%s", corpus, name);
+    return path;
+}
+
+void redirect(const char* path, int flags, int target)
+{
+    int fd = open(path, flags, 0644);
+    if (fd < 0)
+    {
+        perror(path);
+        _exit(127);
+    }
+    dup2(fd, target);
+    close(fd);
+}
+
+// Run letter-boxed with the given arguments and files for stdin and stdout
+run_result run_timed(char* args[], const char* input, const char* output)
+{
+    run_result result = {0, 0, -1};
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Unable to fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        redirect(input, O_RDONLY, STDIN_FILENO);
+        redirect(output, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO);
+        execv(args[0], args);
+        perror("Unable to exec letter-boxed");
+        _exit(127);
+    }
+    struct rusage usage;
+    int status;
+    if (wait4(pid, &status, 0, &usage) < 0)
+    {
+        perror("Unable to wait for letter-boxed");
+        exit(1);
+    }
+    result.seconds = now() - start;
+    result.max_rss_kb = usage.ru_maxrss;
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return result;
+}
+
+int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void report(const char* label, run_result result)
+{
+    printf("%-24s %10.3f ms   rss %8.1f MB%s\n", label, result.seconds * 1e3,
+           result.max_rss_kb / 1024.0, result.status == 0 ? "" : "   (failed)");
+}
+
+// Median time of several runs that each check the sample solution against
+// board; a run fails unless it exits with expected
+void report_load(const char* label, const char* board, const char* dict, int expected)
+{
+    char* args[] = {(char*)program, (char*)board, (char*)dict, NULL};
+    double times[LOAD_RUNS];
+    run_result result = {0, 0, 0};
+    for (int i = 0; i < LOAD_RUNS; i++)
+    {
+        run_result run = run_timed(args, corpus_path("submission.txt"), "/dev/null");
+        times[i] = run.seconds;
+        if (run.max_rss_kb > result.max_rss_kb)
+        result.max_rss_kb = run.max_rss_kb;
+        if (run.status != expected)
+        result.status = -1;
+    }
+    qsort(times, LOAD_RUNS, sizeof(double), compare_double);
+    result.seconds = times[LOAD_RUNS / 2];
+    report(label, result);
+}
+
+void write_all(int fd, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t bytes = write(fd, data, length);
+        if (bytes < 0)
+        {
+            perror("Unable to write to letter-boxed");
+            exit(1);
+        }
+        data += bytes;
+        length -= bytes;
+    }
+}
+
+// Send submissions one by one to --serve and time each verdict
+void report_latency(const char* dict, long count)
+{
+    int fd = open(corpus_path("submissions.bin"), O_RDONLY);
+    struct stat statbuf;
+    if (fd < 0 || fstat(fd, &statbuf) != 0)
+    {
+        perror("Unable to open submissions");
+        exit(1);
+    }
+    size_t length = statbuf.st_size;
+    const char* data = length ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    if (data == MAP_FAILED)
+    {
+        perror("Unable to map submissions");
+        exit(1);
+    }
+    close(fd);
+
+    int to_child[2], from_child[2];
+    if (pipe(to_child) != 0 || pipe(from_child) != 0)
+    {
+        perror("Unable to create pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Unable to fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        char* args[] = {(char*)program, "--serve", (char*)corpus_path("board.txt"), (char*)dict, NULL};
+        execv(args[0], args);
+        perror("Unable to exec letter-boxed");
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+
+    double* latencies = malloc((count > 0 ? count : 1) * sizeof(double));
+    if (latencies == NULL)
+    {
+        perror("Unable to allocate latencies");
+        exit(1);
+    }
+    long measured = 0;
+    size_t position = 0;
+    char line[256];
+    while (measured < count && position < length)
+    {
+        const char* end = memchr(data + position, '\0', length - position);
+        size_t frame = (end ? (size_t)(end - data) : length) - position;
+        double start = now();
+        write_all(to_child[1], data + position, frame);
+        write_all(to_child[1], "", 1);
+        // Verdicts are short, so one line normally arrives in one read
+        size_t got = 0;
+        while (got == 0 || line[got - 1] != '\n')
+        {
+            ssize_t bytes = read(from_child[0], line + got, sizeof(line) - got);
+            if (bytes <= 0)
+            {
+                fprintf(stderr, "letter-boxed --serve stopped answering\n");
+                exit(1);
+            }
+            got += bytes;
+            if (got == sizeof(line))
+            got = 0;
+        }
+        latencies[measured++] = now() - start;
+        position += frame + 1;
+    }
+    close(to_child[1]);
+    close(from_child[0]);
+    struct rusage usage;
+    int status;
+    wait4(pid, &status, 0, &usage);
+    if (length)
+    munmap((void*)data, length);
+
+    if (measured == 0)
+    {
+        printf("%-24s no submissions\n", "serve latency");
+        free(latencies);
+        return;
+    }
+    qsort(latencies, measured, sizeof(double), compare_double);
+    double percentiles[] = {0.50, 0.90, 0.99, 0.999};
+    printf("%-24s", "serve latency (us)");
+    for (int i = 0; i < 4; i++)
+    printf(" p%g %.1f", percentiles[i] * 100, latencies[(long)(percentiles[i] * (measured - 1))] * 1e6);
+    printf(" max %.1f   rss %.1f MB   (%ld submissions)\n", latencies[measured - 1] * 1e6,
+           usage.ru_maxrss / 1024.0, measured);
+    free(latencies);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* jobs = "1";
+    long count = DEFAULT_COUNT;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:n:")) != -1)
+    {
+        if (opt == 'j')
+        jobs = optarg;
+        else if (opt == 'n')
+        count = strtol(optarg, NULL, 10);
+        else
+        {
+            fprintf(stderr, "usage: bench [-j N] [-n COUNT] LETTER_BOXED CORPUS_DIR\n");
+            exit(1);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "usage: bench [-j N] [-n COUNT] LETTER_BOXED CORPUS_DIR\n");
+        exit(1);
+    }
+    program = argv[optind];
+    corpus = argv[optind + 1];
+
+    struct stat dict_stat, batch_stat;
+    if (stat(corpus_path("dict.txt"), &dict_stat) != 0 ||
+        stat(corpus_path("submissions.bin"), &batch_stat) != 0)
+    {
+        perror("Unable to stat corpus");
+        exit(1);
+    }
+    printf("== %s: dictionary %.1f MB, submissions %.1f MB\n", corpus,
+           dict_stat.st_size / 1048576.0, batch_stat.st_size / 1048576.0);
+
+    char* build[] = {(char*)program, "--build-index", (char*)corpus_path("dict.txt"),
+                     (char*)corpus_path("dict.idx"), NULL};
+    report("build index", run_timed(build, "/dev/null", "/dev/null"));
+    report_load("load text dictionary", corpus_path("board.txt"), corpus_path("dict.txt"), 0);
+    report_load("load index", corpus_path("board.txt"), corpus_path("dict.idx"), 0);
+    report_load("invalid board", corpus_path("bad-board.txt"), corpus_path("dict.txt"), 1);
+
+    char* solve[] = {(char*)program, "--solve", (char*)corpus_path("board.txt"),
+                     (char*)corpus_path("dict.txt"), NULL};
+    report("solve", run_timed(solve, "/dev/null", "/dev/null"));
+
+    report_latency(corpus_path("dict.idx"), count);
+
+    char* serve[] = {(char*)program, "--serve", "-j", (char*)jobs, (char*)corpus_path("board.txt"),
+                     (char*)corpus_path("dict.idx"), NULL};
+    run_result batch = run_timed(serve, corpus_path("submissions.bin"), "/dev/null");
+    char label[64];
+    snprintf(label, sizeof(label), "serve -j %s batch", jobs);
+    report(label, batch);
+    printf("%-24s %10.1f MB/s\n", "serve -j throughput",
+           batch_stat.st_size / 1048576.0 / (batch.seconds > 0 ? batch.seconds : 1e-9));
+    return 0;
+}
@@ -0,0 +1,333 @@
+// Synthetic corpus for letter-boxed benchmarks.
+//
+//   gen-corpus DIR WORDS SUBMISSIONS [SEED]
+//
+// writes into DIR:
+//   board.txt        a valid 4x3 board
+//   bad-board.txt    a board that repeats a letter
+//   dict.txt         WORDS words: solution words, playable filler and noise
+//   submission.txt   one correct solution, one word per line
+//   submissions.bin  SUBMISSIONS NUL-separated submissions for --serve:
+//                    correct chains, every kind of invalid one, and
+//                    adversarial ones (huge words, thousands of words)
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define SIDES 4
+#define SIDE_LETTERS 3
+#define BOARD_LETTERS (SIDES * SIDE_LETTERS)
+#define MAX_WORD 16
+#define MAX_CHAIN BOARD_LETTERS
+#define LONG_WORD (1 << 16)
+#define LONG_CHAIN 2000
+
+typedef struct
+{
+    char words[MAX_CHAIN][MAX_WORD + 1];
+    int count;
+} chain;
+
+static uint64_t rng_state = 88172645463325252ULL;
+static char board_letters[BOARD_LETTERS];
+static int side_of[26];
+static char loop_words[26][MAX_WORD + 1]; // Start and end on the same letter
+
+uint64_t next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+uint32_t random_below(uint32_t bound)
+{
+    return (uint32_t)(next_random() % bound);
+}
+
+FILE* open_output(const char* dir, const char* name)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror("Unable to open file");
+        exit(1);
+    }
+    return file;
+}
+
+void make_board(void)
+{
+    char alphabet[26];
+    for (int i = 0; i < 26; i++)
+    {
+        alphabet[i] = 'a' + i;
+        side_of[i] = -1;
+    }
+    for (int i = 0; i < BOARD_LETTERS; i++)
+    {
+        int j = i + random_below(26 - i);
+        char swap = alphabet[i];
+        alphabet[i] = alphabet[j];
+        alphabet[j] = swap;
+        board_letters[i] = alphabet[i];
+        side_of[alphabet[i] - 'a'] = i / SIDE_LETTERS;
+    }
+}
+
+// A letter on the board that is not on the same side as previous
+char next_letter(char previous)
+{
+    while (1)
+    {
+        char letter = board_letters[random_below(BOARD_LETTERS)];
+        if (previous == 0 || side_of[letter - 'a'] != side_of[previous - 'a'])
+        return letter;
+    }
+}
+
+// A board letter whose side differs from both neighbours
+char bridge_letter(char before, char after)
+{
+    while (1)
+    {
+        char letter = next_letter(before);
+        if (side_of[letter - 'a'] != side_of[after - 'a'])
+        return letter;
+    }
+}
+
+// Random walk over the board from first (or anywhere) ending on last (if
+// set); length must be at least 3 when last is given
+void board_word(char* out, int length, char first, char last)
+{
+    out[0] = first ? first : next_letter(0);
+    int walk = last ? length - 2 : length;
+    for (int i = 1; i < walk; i++)
+    out[i] = next_letter(out[i - 1]);
+    if (last)
+    {
+        out[length - 2] = bridge_letter(out[length - 3], last);
+        out[length - 1] = last;
+    }
+    out[length] = '\0';
+}
+
+void random_word(char* out, int length)
+{
+    for (int i = 0; i < length; i++)
+    out[i] = 'a' + random_below(26);
+    out[length] = '\0';
+}
+
+uint32_t word_mask(const char* word)
+{
+    uint32_t mask = 0;
+    for (; *word; word++)
+    mask |= 1u << (*word - 'a');
+    return mask;
+}
+
+// Build a correct solution: each word starts on the previous word's last
+// letter and ends on a letter that is still missing, so it always finishes
+// within one word per board letter
+void make_chain(chain* result)
+{
+    uint32_t goal = 0;
+    for (int i = 0; i < BOARD_LETTERS; i++)
+    goal |= 1u << (board_letters[i] - 'a');
+    uint32_t mask = 0;
+    char last = 0;
+    result->count = 0;
+    while (mask != goal && result->count < MAX_CHAIN)
+    {
+        char target = 0;
+        int start = random_below(BOARD_LETTERS);
+        for (int i = 0; i < BOARD_LETTERS && target == 0; i++)
+        {
+            char letter = board_letters[(start + i) % BOARD_LETTERS];
+            if (!(mask & (1u << (letter - 'a'))) && letter != last)
+            target = letter;
+        }
+        char* word = result->words[result->count++];
+        board_word(word, 4 + random_below(MAX_WORD - 4), last, target);
+        mask |= word_mask(word);
+        last = word[strlen(word) - 1];
+    }
+}
+
+void write_chain(FILE* out, const chain* c)
+{
+    for (int i = 0; i < c->count; i++)
+    fprintf(out, "%s\n", c->words[i]);
+}
+
+void write_submission(FILE* out, const chain* chains, int chain_count)
+{
+    const chain* c = &chains[random_below(chain_count)];
+    uint32_t kind = random_below(100);
+    char word[MAX_WORD + 2];
+    if (kind < 50 || c->count < 2)
+    write_chain(out, c); // Correct
+    else if (kind < 60)
+    {
+        // Word not found: extend one word with a fresh letter
+        int broken = random_below(c->count);
+        for (int i = 0; i < c->count; i++)
+        {
+            if (i == broken)
+            {
+                size_t length = strlen(c->words[i]);
+                fprintf(out, "%.*s%c%c\n", (int)length - 1, c->words[i],
+                        bridge_letter(c->words[i][length - 2], c->words[i][length - 1]),
+                        c->words[i][length - 1]);
+            }
+            else
+            fprintf(out, "%s\n", c->words[i]);
+        }
+    }
+    else if (kind < 70)
+    {
+        // First letter mismatch: swap the first two words
+        fprintf(out, "%s\n%s\n", c->words[1], c->words[0]);
+        for (int i = 2; i < c->count; i++)
+        fprintf(out, "%s\n", c->words[i]);
+    }
+    else if (kind < 80)
+    fprintf(out, "%s\n", c->words[0]); // Not all letters used
+    else if (kind < 85)
+    {
+        // A letter that is not on the board
+        char outside = 'a';
+        while (side_of[outside - 'a'] != -1)
+        outside++;
+        write_chain(out, c);
+        fprintf(out, "%c%c\n", c->words[c->count - 1][strlen(c->words[c->count - 1]) - 1], outside);
+    }
+    else if (kind < 90)
+    {
+        // Same-side letters next to each other, inside the first word
+        strcpy(word, c->words[0]);
+        size_t length = strlen(word);
+        size_t at = 1 + random_below(length - 1);
+        char letter = word[at - 1];
+        memmove(word + at + 1, word + at, length - at + 1);
+        word[at] = board_letters[side_of[letter - 'a'] * SIDE_LETTERS + random_below(SIDE_LETTERS)];
+        fprintf(out, "%s\n", word);
+        for (int i = 1; i < c->count; i++)
+        fprintf(out, "%s\n", c->words[i]);
+    }
+    else if (kind < 95)
+    {
+        // Adversarial: one enormous word that walks the whole board
+        char previous = 0;
+        int length = LONG_WORD / 2 + random_below(LONG_WORD / 2);
+        for (int i = 0; i < length; i++)
+        {
+            previous = next_letter(previous);
+            fputc(previous, out);
+        }
+        fputc('\n', out);
+    }
+    else
+    {
+        // Adversarial: a correct chain followed by thousands of loop words
+        write_chain(out, c);
+        const char* last_word = c->words[c->count - 1];
+        const char* loop = loop_words[last_word[strlen(last_word) - 1] - 'a'];
+        for (int i = 0; i < LONG_CHAIN; i++)
+        fprintf(out, "%s\n", loop);
+    }
+    fputc('\0', out);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 4 && argc != 5)
+    {
+        fprintf(stderr, "usage: gen-corpus DIR WORDS SUBMISSIONS [SEED]\n");
+        exit(1);
+    }
+    const char* dir = argv[1];
+    long words = strtol(argv[2], NULL, 10);
+    long submissions = strtol(argv[3], NULL, 10);
+    if (argc == 5)
+    rng_state ^= strtoull(argv[4], NULL, 10) * 0x9e3779b97f4a7c15ULL;
+    if (words < 1 || submissions < 0)
+    {
+        fprintf(stderr, "WORDS must be positive and SUBMISSIONS not negative\n");
+        exit(1);
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        perror("Unable to create corpus directory");
+        exit(1);
+    }
+
+    make_board();
+    FILE* board = open_output(dir, "board.txt");
+    FILE* bad_board = open_output(dir, "bad-board.txt");
+    for (int side = 0; side < SIDES; side++)
+    {
+        fprintf(board, "%.*s\n", SIDE_LETTERS, board_letters + side * SIDE_LETTERS);
+        fprintf(bad_board, "%.*s\n", SIDE_LETTERS, board_letters + side * SIDE_LETTERS);
+    }
+    fprintf(bad_board, "%c\n", board_letters[0]);
+    fclose(board);
+    fclose(bad_board);
+
+    // A few solutions shared by all submissions, about one word in eight
+    int chain_count = words / 32 > 0 ? (words / 32 < 4096 ? words / 32 : 4096) : 1;
+    chain* chains = malloc(chain_count * sizeof(chain));
+    if (chains == NULL)
+    {
+        perror("Unable to allocate chains");
+        exit(1);
+    }
+    long written = 0;
+    FILE* dict = open_output(dir, "dict.txt");
+    for (int i = 0; i < chain_count; i++)
+    {
+        make_chain(&chains[i]);
+        for (int j = 0; j < chains[i].count && written < words; j++, written++)
+        fprintf(dict, "%s\n", chains[i].words[j]);
+    }
+    for (int i = 0; i < BOARD_LETTERS; i++)
+    {
+        char letter = board_letters[i];
+        board_word(loop_words[letter - 'a'], 5, letter, letter);
+        fprintf(dict, "%s\n", loop_words[letter - 'a']);
+        written++;
+    }
+    // Filler: a fifth playable on the board, the rest arbitrary letters
+    char word[MAX_WORD + 1];
+    for (; written < words; written++)
+    {
+        int length = 3 + random_below(MAX_WORD - 3);
+        if (random_below(5) == 0)
+        board_word(word, length, 0, 0);
+        else
+        random_word(word, length);
+        fprintf(dict, "%s\n", word);
+    }
+    fclose(dict);
+
+    FILE* solution = open_output(dir, "submission.txt");
+    write_chain(solution, &chains[0]);
+    fclose(solution);
+
+    FILE* batch = open_output(dir, "submissions.bin");
+    for (long i = 0; i < submissions; i++)
+    write_submission(batch, chains, chain_count);
+    fclose(batch);
+    free(chains);
+    return 0;
+}
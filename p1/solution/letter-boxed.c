@@ -1,305 +1,1537 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
-#define INIT_BUFFER 8
+#define READ_CHUNK (1 << 16)
+#define INDEX_MAGIC "LBOXIDX2" // The last byte is the format version
+#define MAX_JOBS 256
+#define JOB_GRAIN 64
+#define FILTER_NEWLINE 0x80
+#define FILTER_SPAN 1024 // 32-byte blocks classified per call
+#define SERVE_FRAMES 1024 // Initial frame table of a --serve batch
 
-char* read_file_dynamically(const char* file_path)
+// A loaded input: either a read-only mapping of a regular file or a heap
+// buffer filled with large read() calls. Never NUL-terminated.
+typedef struct
 {
-    FILE* file = fopen(file_path, "r");
-    if (file == NULL)
+    const char* data;
+    size_t length;
+    bool mapped;
+} text_buffer;
+
+// A word inside a text_buffer, delimited by length instead of '\0'
+typedef struct
+{
+    const char* start;
+    size_t length;
+} word_view;
+
+text_buffer read_fd(int fd)
+{
+    text_buffer text = {NULL, 0, false};
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1)
     {
-        perror("Unable to open file");
+        perror("Unable to stat file");
         exit(1);
     }
-    size_t size = INIT_BUFFER;
+    // Regular files are mapped directly, so loading costs page faults only
+    if (S_ISREG(statbuf.st_mode) && statbuf.st_size > 0)
+    {
+        void* map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, statbuf.st_size, MADV_WILLNEED);
+            text.data = map;
+            text.length = statbuf.st_size;
+            text.mapped = true;
+            return text;
+        }
+    }
+    // Pipes, terminals and empty files are read in large chunks
+    size_t size = READ_CHUNK;
     size_t length = 0;
     char* buffer = malloc(size);
     if (buffer == NULL)
     {
         perror("Unable to allocate buffer");
-        fclose(file);
         exit(1);
     }
-    int ch;
-    while ((ch = fgetc(file)) != EOF)
+    while (1)
     {
-        if (length >= size - 1)
+        if (length == size)
         {
             size_t new_size = size * 2;
             char* new_buffer = realloc(buffer, new_size);
             if (new_buffer == NULL)
             {
                 perror("Unable to reallocate buffer");
-                fclose(file);
                 free(buffer);
                 exit(1);
             }
             buffer = new_buffer;
             size = new_size;
         }
-        buffer[length++] = (char)ch;
+        ssize_t bytes = read(fd, buffer + length, size - length);
+        if (bytes < 0)
+        {
+            perror("Unable to read file");
+            free(buffer);
+            exit(1);
+        }
+        if (bytes == 0)
+        break;
+        length += bytes;
     }
-    buffer[length] = '\0';
-    fclose(file);
-    return buffer;
+    text.data = buffer;
+    text.length = length;
+    return text;
 }
 
-char* read_stdin(void)
+text_buffer read_file_dynamically(const char* file_path)
 {
-    size_t size = INIT_BUFFER;
-    size_t length = 0;
-    char* buffer = malloc(size);
-    if (buffer == NULL)
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
     {
-        perror("Unable to allocate buffer");
+        perror("Unable to open file");
         exit(1);
     }
-    int ch;
-    while ((ch = getchar()) != EOF)
+    text_buffer text = read_fd(fd);
+    close(fd);
+    return text;
+}
+
+void free_text(text_buffer* text)
+{
+    if (text->mapped)
+    munmap((void*)text->data, text->length);
+    else
+    free((void*)text->data);
+    text->data = NULL;
+    text->length = 0;
+}
+
+// Bump allocator for everything a run needs. The first block is sized up
+// front from the input lengths; should that fall short (e.g. a huge word
+// on a pipe) another block is chained on. Saving the arena by value and
+// resetting to the copy releases everything allocated in between.
+typedef struct arena_block
+{
+    struct arena_block* previous;
+    size_t capacity;
+} arena_block;
+
+typedef struct
+{
+    arena_block* block;
+    size_t used;
+} arena;
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_add_block(arena* memory, size_t capacity)
+{
+    arena_block* block = malloc(ARENA_ROUND(sizeof(arena_block)) + capacity);
+    if (block == NULL)
     {
-        if (length >= size - 1)
-        {
-            size_t new_size = size * 2;
-            char* new_buffer = realloc(buffer, new_size);
-            if (new_buffer == NULL)
-            {
-                perror("Unable to reallocate buffer");
-                free(buffer);
-                exit(1);
-            }
-            buffer = new_buffer;
-            size = new_size;
-        }
-        buffer[length++] = (char)ch;
+        perror("Unable to allocate memory");
+        exit(1);
     }
-    buffer[length] = '\0';
-    return buffer;
+    block->previous = memory->block;
+    block->capacity = capacity;
+    memory->block = block;
+    memory->used = 0;
 }
 
+void arena_init(arena* memory, size_t capacity)
+{
+    memory->block = NULL;
+    arena_add_block(memory, ARENA_ROUND(capacity));
+}
 
-int* check_board(char* buffer)
+char* arena_top(const arena* memory)
 {
-    int* alpha_set = malloc(26 * sizeof(int));
-    if (alpha_set == NULL)
+    return (char*)memory->block + ARENA_ROUND(sizeof(arena_block)) + memory->used;
+}
+
+void* arena_alloc(arena* memory, size_t size)
+{
+    size = ARENA_ROUND(size);
+    if (size > memory->block->capacity - memory->used)
     {
-        perror("Unable to allocate memory for alpha_set");
-        exit(1);
+        size_t capacity = memory->block->capacity * 2;
+        arena_add_block(memory, size > capacity ? size : capacity);
     }
-    for (int i = 0; i < 26; i++) {
-        alpha_set[i] = 0;
+    void* result = arena_top(memory);
+    memory->used += size;
+    return result;
+}
+
+void* arena_calloc(arena* memory, size_t size)
+{
+    void* result = arena_alloc(memory, size);
+    memset(result, 0, size);
+    return result;
+}
+
+// Grow an allocation, in place when it is the most recent one
+void* arena_resize(arena* memory, void* old, size_t old_size, size_t new_size)
+{
+    if (old != NULL && (char*)old + ARENA_ROUND(old_size) == arena_top(memory) &&
+        ARENA_ROUND(new_size) - ARENA_ROUND(old_size) <= memory->block->capacity - memory->used)
+    {
+        memory->used += ARENA_ROUND(new_size) - ARENA_ROUND(old_size);
+        return old;
+    }
+    void* result = arena_alloc(memory, new_size);
+    if (old_size > 0)
+    memcpy(result, old, old_size);
+    return result;
+}
+
+void arena_reset(arena* memory, arena saved)
+{
+    while (memory->block != saved.block)
+    {
+        arena_block* previous = memory->block->previous;
+        free(memory->block);
+        memory->block = previous;
     }
+    memory->used = saved.used;
+}
+
+void arena_free(arena* memory)
+{
+    arena empty = {NULL, 0};
+    arena_reset(memory, empty);
+}
+
+
+// Outcome of validating a board or a submission, in reporting order
+typedef enum
+{
+    VERDICT_CORRECT,
+    VERDICT_INVALID_BOARD,
+    VERDICT_NOT_A_TO_Z,
+    VERDICT_FIRST_LETTER,
+    VERDICT_LETTER_NOT_ON_BOARD,
+    VERDICT_NOT_ALL_LETTERS,
+    VERDICT_SAME_SIDE,
+    VERDICT_NOT_IN_DICTIONARY
+} verdict;
+
+const char* verdict_messages[] =
+{
+    "Correct",
+    "Invalid board",
+    "Input not from a to z",
+    "First letter of word does not match last letter of previous word",
+    "Used a letter not present on the board",
+    "Not all letters used",
+    "Same-side letter used consecutively",
+    "Word not found in dictionary"
+};
+
+int verdict_exit_code(verdict result)
+{
+    return (result == VERDICT_INVALID_BOARD || result == VERDICT_NOT_A_TO_Z) ? 1 : 0;
+}
+
+typedef struct
+{
+    uint32_t letters; // Bit i set if letter 'a' + i is on the board
+    int letter_row[26]; // Side of each letter, -1 if absent
+} board;
+
+// Validate and parse the board in one pass
+verdict check_board(const char* buffer, size_t length, board* result)
+{
+    result->letters = 0;
+    memset(result->letter_row, -1, sizeof(result->letter_row));
     int lines = 0;
-    for (char* ch_ptr = buffer; *ch_ptr != '\0'; ch_ptr++)
+    for (const char* ch_ptr = buffer; ch_ptr < buffer + length; ch_ptr++)
     {
         if (*ch_ptr == '\n')
         lines++;
         else if (*ch_ptr <= 'z' && *ch_ptr >= 'a')
         {
-            if (alpha_set[*ch_ptr - 'a'] > 0)
-            {
-                printf("Invalid board\n");
-                exit(1);
-            }
-            else
-            alpha_set[*ch_ptr - 'a']++;
+            uint32_t bit = 1u << (*ch_ptr - 'a');
+            if (result->letters & bit)
+            return VERDICT_INVALID_BOARD;
+            result->letters |= bit;
+            result->letter_row[*ch_ptr - 'a'] = lines;
         }
         else
+        return VERDICT_NOT_A_TO_Z;
+    }
+    if (lines < 3)
+    return VERDICT_INVALID_BOARD;
+    return VERDICT_CORRECT;
+}
+
+
+// Upper bound on the number of lines: one more than the line breaks
+size_t count_lines(const char* data, size_t length)
+{
+    size_t lines = 1;
+    for (const char* p = data; (p = memchr(p, '\n', data + length - p)) != NULL; p++)
+    lines++;
+    return lines;
+}
+
+// Split a read-only buffer into views of its non-empty lines
+word_view* split_lines(const text_buffer* text, size_t lines, int* count, arena* memory)
+{
+    word_view* result = arena_alloc(memory, lines * sizeof(word_view));
+    *count = 0;
+    const char* line = text->data;
+    const char* end = text->data + text->length;
+    while (line < end)
+    {
+        const char* newline = memchr(line, '\n', end - line);
+        if (newline == NULL)
+        newline = end;
+        if (newline > line)
+        {
+            result[*count].start = line;
+            result[*count].length = newline - line;
+            (*count)++;
+        }
+        line = newline + 1;
+    }
+    return result;
+}
+
+int compare_view(const word_view* a, const word_view* b)
+{
+    size_t common = a->length < b->length ? a->length : b->length;
+    int res = memcmp(a->start, b->start, common);
+    if (res != 0)
+    return res;
+    return (a->length > b->length) - (a->length < b->length);
+}
+
+// Prebuilt dictionary index, written by --build-index and mapped as is.
+// Layout (native byte order): header, slot_count hash slots, then the
+// word_count sorted words separated by '\n'.
+typedef struct
+{
+    char magic[8];
+    uint32_t word_count;
+    uint32_t slot_count;
+    uint32_t blob_length;
+    uint32_t reserved;
+} index_header;
+
+// Open-addressing slot: high half of the word hash and offset + 1 (0 = empty)
+typedef struct
+{
+    uint32_t fingerprint;
+    uint32_t offset;
+} dict_slot;
+
+// A dictionary is an open-addressing hash set over '\n'-separated words
+// stored in base: the mapped text file itself, or the blob of an index
+typedef struct
+{
+    text_buffer file;
+    uint32_t count;
+    const dict_slot* slots; // NULL until a text dictionary is hashed
+    uint32_t slot_mask;
+    const char* base;
+    size_t base_length;
+} dictionary;
+
+uint64_t hash_word(const char* start, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)start[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t slot_count_for(size_t words)
+{
+    uint32_t slot_count = 1;
+    while (slot_count < 2 * words)
+    slot_count *= 2;
+    return slot_count;
+}
+
+// Probe for a word; returns its slot, or the empty slot ending the probe
+uint32_t find_slot(const dict_slot* slots, uint32_t slot_mask, const char* base,
+                   size_t base_length, const char* start, size_t length, uint64_t hash)
+{
+    uint32_t fingerprint = hash >> 32;
+    uint32_t slot = hash & slot_mask;
+    for (; slots[slot].offset != 0; slot = (slot + 1) & slot_mask)
+    {
+        if (slots[slot].fingerprint != fingerprint)
+        continue;
+        size_t offset = slots[slot].offset - 1;
+        if (offset >= base_length || length > base_length - offset)
+        continue;
+        const char* candidate = base + offset;
+        if ((length == base_length - offset || candidate[length] == '\n') &&
+            memcmp(candidate, start, length) == 0)
+        break;
+    }
+    return slot;
+}
+
+// Add the word at base + offset unless it is already present
+bool insert_word(dict_slot* slots, uint32_t slot_mask, const char* base,
+                 size_t base_length, size_t offset, size_t length)
+{
+    uint64_t hash = hash_word(base + offset, length);
+    uint32_t slot = find_slot(slots, slot_mask, base, base_length, base + offset, length, hash);
+    if (slots[slot].offset != 0)
+    return false;
+    slots[slot].fingerprint = hash >> 32;
+    slots[slot].offset = offset + 1;
+    return true;
+}
+
+int compare_view_qsort(const void* a, const void* b)
+{
+    return compare_view(a, b);
+}
+
+void write_all(int fd, const void* data, size_t length)
+{
+    const char* p = data;
+    while (length > 0)
+    {
+        ssize_t bytes = write(fd, p, length);
+        if (bytes < 0)
         {
-            printf("Input not from a to z\n");
+            perror("Unable to write index");
             exit(1);
         }
+        p += bytes;
+        length -= bytes;
     }
-    if (lines < 3)
+}
+
+int build_index(const char* dict_path, const char* index_path)
+{
+    text_buffer file_dict = read_file_dynamically(dict_path);
+    // Line table, blob and slots, each bounded by the file size
+    size_t lines = count_lines(file_dict.data, file_dict.length);
+    arena memory;
+    arena_init(&memory, lines * sizeof(word_view) + ARENA_ROUND(file_dict.length + 2) +
+               slot_count_for(lines) * sizeof(dict_slot) + 3 * ARENA_ALIGN);
+    int dict_size;
+    word_view* words = split_lines(&file_dict, lines, &dict_size, &memory);
+    if (dict_size > 0)
+    qsort(words, dict_size, sizeof(word_view), compare_view_qsort);
+
+    // Drop duplicates and lay the sorted words out back to back
+    size_t blob_length = 0;
+    int unique = 0;
+    for (int i = 0; i < dict_size; i++)
+    {
+        if (unique > 0 && compare_view(&words[unique - 1], &words[i]) == 0)
+        continue;
+        words[unique++] = words[i];
+        blob_length += words[i].length + 1;
+    }
+    if (blob_length >= UINT32_MAX)
     {
-        printf("Invalid board\n");
+        fprintf(stderr, "Dictionary too large to index\n");
         exit(1);
     }
+    uint32_t slot_count = slot_count_for(unique);
+
+    char* blob = arena_alloc(&memory, blob_length + 1);
+    dict_slot* slots = arena_calloc(&memory, slot_count * sizeof(dict_slot));
+    uint32_t offset = 0;
+    for (int i = 0; i < unique; i++)
+    {
+        memcpy(blob + offset, words[i].start, words[i].length);
+        blob[offset + words[i].length] = '\n';
+        insert_word(slots, slot_count - 1, blob, blob_length, offset, words[i].length);
+        offset += words[i].length + 1;
+    }
 
-    return alpha_set;
+    index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.word_count = unique;
+    header.slot_count = slot_count;
+    header.blob_length = blob_length;
+
+    int fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("Unable to open file");
+        exit(1);
+    }
+    write_all(fd, &header, sizeof(header));
+    write_all(fd, slots, slot_count * sizeof(dict_slot));
+    write_all(fd, blob, blob_length);
+    if (close(fd) != 0)
+    {
+        perror("Unable to write index");
+        exit(1);
+    }
+    arena_free(&memory);
+    free_text(&file_dict);
+    return 0;
+}
+
+// Hash every line of a text dictionary in place; order does not matter
+void build_text_dictionary(dictionary* dict, size_t lines, arena* memory)
+{
+    const char* base = dict->file.data;
+    size_t length = dict->file.length;
+    if (length >= UINT32_MAX)
+    {
+        fprintf(stderr, "Dictionary too large\n");
+        exit(1);
+    }
+    uint32_t slot_count = slot_count_for(lines);
+    dict_slot* slots = arena_calloc(memory, slot_count * sizeof(dict_slot));
+    dict->slots = slots;
+    dict->slot_mask = slot_count - 1;
+    dict->base = base;
+    dict->base_length = length;
+    size_t start = 0;
+    while (start < length)
+    {
+        const char* newline = memchr(base + start, '\n', length - start);
+        size_t end = newline ? (size_t)(newline - base) : length;
+        if (end > start &&
+            insert_word(slots, dict->slot_mask, base, length, start, end - start))
+        dict->count++;
+        start = end + 1;
+    }
+}
+
+// Open a dictionary; files starting with INDEX_MAGIC are used in place.
+// A text dictionary still needs build_text_dictionary() before lookups,
+// which modes that only scan the words skip.
+dictionary load_dictionary(const char* file_path)
+{
+    dictionary dict;
+    memset(&dict, 0, sizeof(dict));
+    dict.file = read_file_dynamically(file_path);
+    if (dict.file.length < sizeof(index_header) ||
+        memcmp(dict.file.data, INDEX_MAGIC, sizeof(INDEX_MAGIC) - 2) != 0)
+    {
+        dict.base = dict.file.data;
+        dict.base_length = dict.file.length;
+        return dict;
+    }
+    index_header header;
+    memcpy(&header, dict.file.data, sizeof(header));
+    size_t expected = sizeof(header) + (size_t)header.slot_count * sizeof(dict_slot) +
+        header.blob_length;
+    // An index of another version is an error, not a text dictionary
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        expected != dict.file.length || header.slot_count == 0 ||
+        (header.slot_count & (header.slot_count - 1)) != 0)
+    {
+        fprintf(stderr, "Invalid dictionary index\n");
+        exit(1);
+    }
+    dict.count = header.word_count;
+    dict.slots = (const dict_slot*)(dict.file.data + sizeof(header));
+    dict.slot_mask = header.slot_count - 1;
+    dict.base = (const char*)(dict.slots + header.slot_count);
+    dict.base_length = header.blob_length;
+    return dict;
+}
+
+int dictionary_contains(const dictionary* dict, const word_view* word)
+{
+    uint64_t hash = hash_word(word->start, word->length);
+    uint32_t slot = find_slot(dict->slots, dict->slot_mask, dict->base, dict->base_length,
+                              word->start, word->length, hash);
+    return dict->slots[slot].offset != 0;
 }
 
-void parse_board(const char* board, int* letter_row)
+void free_dictionary(dictionary* dict)
 {
-    int current_row = 0;
-    for (const char* p = board; *p; p++)
+    free_text(&dict->file);
+}
+
+// Streaming validator: every rule is computed in one pass over the input,
+// which may arrive in any number of chunks. Same-side and dictionary
+// errors are only recorded when seen, since the letter set checks at the
+// end outrank them; first-letter and a to z errors end the scan at once.
+typedef struct
+{
+    const board* file_board;
+    const dictionary* dict;
+    uint32_t used; // Letters used so far
+    char previous; // Previous letter, across line breaks
+    int last_row; // Side of the previous letter in the current word
+    bool new_line;
+    verdict stopped;
+    bool same_side;
+    bool missing_word;
+    arena* memory;
+    char* word; // Start of a word that spans two chunks
+    size_t word_length;
+    size_t word_capacity;
+} validator;
+
+void validator_init(validator* v, const board* file_board, const dictionary* dict, arena* memory)
+{
+    memset(v, 0, sizeof(*v));
+    v->file_board = file_board;
+    v->dict = dict;
+    v->memory = memory;
+    v->last_row = -1;
+    v->new_line = true;
+    v->stopped = VERDICT_CORRECT;
+}
+
+void validator_keep(validator* v, const char* start, size_t length)
+{
+    if (v->word_length + length > v->word_capacity)
     {
-        if (*p == '\n')
-        current_row++;
-        else if (*p >= 'a' && *p <= 'z')
-        letter_row[*p - 'a'] = current_row;
+        size_t new_capacity = v->word_capacity ? v->word_capacity * 2 : 64;
+        while (new_capacity < v->word_length + length)
+        new_capacity *= 2;
+        v->word = arena_resize(v->memory, v->word, v->word_capacity, new_capacity);
+        v->word_capacity = new_capacity;
     }
+    memcpy(v->word + v->word_length, start, length);
+    v->word_length += length;
 }
 
+void validator_end_word(validator* v, const char* start, size_t length)
+{
+    word_view word = {start, length};
+    if (v->word_length > 0)
+    {
+        if (length > 0)
+        validator_keep(v, start, length);
+        word.start = v->word;
+        word.length = v->word_length;
+        v->word_length = 0;
+    }
+    if (!v->missing_word && !dictionary_contains(v->dict, &word))
+    v->missing_word = true;
+}
 
-int check_conseq(const char* std_input, const int* letter_row)
+// Feed the next chunk; returns false once the verdict cannot change
+bool validator_feed(validator* v, const char* data, size_t length)
 {
-    char last_char = 0;
-    int last_row = -1;
-    bool new_word = true;
-    for (const char* ch_ptr = std_input; *ch_ptr; ch_ptr++)
+    const int* letter_row = v->file_board->letter_row;
+    const char* end = data + length;
+    const char* word_start = data;
+    for (const char* p = data; p < end; p++)
     {
-        if (*ch_ptr == '\n' || *ch_ptr == ' ')
+        char ch = *p;
+        if (ch == '\n')
         {
-            new_word = true;
-            last_char = 0;
-            last_row = -1;
+            if (!v->new_line)
+            validator_end_word(v, word_start, p - word_start);
+            v->new_line = true;
             continue;
         }
-        if (!new_word) {
-            int current_row = letter_row[*ch_ptr - 'a'];
-            if (last_char == *ch_ptr)
-            {
-                printf("Same-side letter used consecutively\n");
-                exit(0);
-            }
-            if (last_row == current_row && last_row != -1)
+        bool first = v->new_line;
+        if (first)
+        {
+            if (v->previous && v->previous != ch)
             {
-                printf("Same-side letter used consecutively\n");
-                exit(0);
+                v->stopped = VERDICT_FIRST_LETTER;
+                return false;
             }
+            v->new_line = false;
+            word_start = p;
         }
-        last_char = *ch_ptr;
-        last_row = letter_row[*ch_ptr - 'a'];
-        new_word = false;
+        if (ch < 'a' || ch > 'z')
+        {
+            v->stopped = VERDICT_NOT_A_TO_Z;
+            return false;
+        }
+        int row = letter_row[ch - 'a'];
+        if (!first && (ch == v->previous || (row == v->last_row && row != -1)))
+        v->same_side = true;
+        v->used |= 1u << (ch - 'a');
+        v->previous = ch;
+        v->last_row = row;
     }
+    if (!v->new_line)
+    validator_keep(v, word_start, end - word_start);
+    return true;
+}
 
-    return 0;
+verdict validator_finish(validator* v)
+{
+    if (v->stopped != VERDICT_CORRECT)
+    return v->stopped;
+    if (!v->new_line)
+    validator_end_word(v, NULL, 0);
+    // Letters are checked in alphabetical order, whichever rule fails first
+    uint32_t mismatch = v->used ^ v->file_board->letters;
+    if (mismatch != 0)
+    {
+        uint32_t bit = mismatch & -mismatch;
+        return (v->used & bit) ? VERDICT_LETTER_NOT_ON_BOARD : VERDICT_NOT_ALL_LETTERS;
+    }
+    if (v->same_side)
+    return VERDICT_SAME_SIDE;
+    if (v->missing_word)
+    return VERDICT_NOT_IN_DICTIONARY;
+    return VERDICT_CORRECT;
+}
+
+// Full check of one submission; touches only its arguments, and leaves
+// memory as it found it
+verdict validate_submission(const char* std_input, size_t length, const board* file_board,
+                            const dictionary* dict, arena* memory)
+{
+    arena saved = *memory;
+    validator v;
+    validator_init(&v, file_board, dict, memory);
+    validator_feed(&v, std_input, length);
+    verdict result = validator_finish(&v);
+    arena_reset(memory, saved);
+    return result;
 }
 
-int check_input(char* std_input, char* file_board, int* alpha_set)
+// Check a single submission from fd without holding all of it in memory
+verdict validate_stream(int fd, const board* file_board, const dictionary* dict, arena* memory)
 {
-    int* alpha_set_std_input = malloc(26 * sizeof(int));
-    if (alpha_set_std_input == NULL)
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+    {
+        text_buffer text = read_fd(fd);
+        verdict result = validate_submission(text.data, text.length, file_board, dict, memory);
+        free_text(&text);
+        return result;
+    }
+    char* chunk = arena_alloc(memory, READ_CHUNK);
+    validator v;
+    validator_init(&v, file_board, dict, memory);
+    ssize_t bytes;
+    while ((bytes = read(fd, chunk, READ_CHUNK)) > 0)
+    {
+        if (!validator_feed(&v, chunk, bytes))
+        break;
+    }
+    if (bytes < 0)
     {
-        perror("Unable to allocate memory for alpha_set_std_input");
+        perror("Unable to read file");
         exit(1);
     }
+    return validator_finish(&v);
+}
+
+// Byte classes for the dictionary filter: 0 rejects the word (a letter
+// not on the board or any other byte), FILTER_NEWLINE ends a word, and
+// letters map to a side id 1..26. A word is playable when no byte is 0 and
+// no two neighbouring letters share a side id.
+typedef struct
+{
+    uint8_t code[256];
+    uint8_t low6[16]; // code[0x60 | nibble], 'a'..'o'
+    uint8_t low7[16]; // code[0x70 | nibble], 'p'..'z'
+} filter_tables;
+
+void build_filter_tables(const board* file_board, filter_tables* tables)
+{
+    memset(tables, 0, sizeof(*tables));
+    // Side numbers can exceed 255 with blank lines, so renumber them densely
+    int side_ids[26];
+    int row_of_id[26];
+    int sides = 0;
     for (int i = 0; i < 26; i++)
     {
-        alpha_set_std_input[i] = 0;
+        int row = file_board->letter_row[i];
+        side_ids[i] = 0;
+        if (row == -1)
+        continue;
+        int id = 0;
+        while (id < sides && row_of_id[id] != row)
+        id++;
+        if (id == sides)
+        row_of_id[sides++] = row;
+        side_ids[i] = id + 1;
     }
-    char last_char = 0;
-    char first_char = 0;
-    bool new_line = true;
-    for (char* ch_ptr = std_input; *ch_ptr != '\0'; ch_ptr++)
+    for (int i = 0; i < 26; i++)
+    tables->code['a' + i] = side_ids[i];
+    tables->code['\n'] = FILTER_NEWLINE;
+    memcpy(tables->low6, tables->code + 0x60, 16);
+    memcpy(tables->low7, tables->code + 0x70, 16);
+}
+
+// Classify blocks of 32 bytes: bit i of bad[b] is set when byte i of block
+// b rejects its word, bit i of newline[b] when it is a line break.
+// Every block reads one byte before its start.
+void classify_blocks_scalar(const char* p, size_t blocks, const filter_tables* tables,
+                            uint32_t* bad, uint32_t* newline)
+{
+    for (size_t b = 0; b < blocks; b++, p += 32)
     {
-        if (*ch_ptr == '\n')
+        uint32_t bad_bits = 0;
+        uint32_t newline_bits = 0;
+        uint8_t previous = tables->code[(unsigned char)p[-1]];
+        for (int i = 0; i < 32; i++)
         {
-            new_line = true;
-            continue;
+            uint8_t code = tables->code[(unsigned char)p[i]];
+            if (code == FILTER_NEWLINE)
+            newline_bits |= 1u << i;
+            else if (code == 0 || code == previous)
+            bad_bits |= 1u << i;
+            previous = code;
         }
-        if (new_line)
+        bad[b] = bad_bits;
+        newline[b] = newline_bits;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static __m256i side_codes_avx2(__m256i bytes, __m256i low6, __m256i low7)
+{
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i low = _mm256_and_si256(bytes, nibble);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+    __m256i code6 = _mm256_and_si256(_mm256_shuffle_epi8(low6, low),
+                                     _mm256_cmpeq_epi8(high, _mm256_set1_epi8(6)));
+    __m256i code7 = _mm256_and_si256(_mm256_shuffle_epi8(low7, low),
+                                     _mm256_cmpeq_epi8(high, _mm256_set1_epi8(7)));
+    __m256i line = _mm256_and_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')),
+                                    _mm256_set1_epi8((char)FILTER_NEWLINE));
+    return _mm256_or_si256(_mm256_or_si256(code6, code7), line);
+}
+
+__attribute__((target("avx2")))
+void classify_blocks_avx2(const char* p, size_t blocks, const filter_tables* tables,
+                          uint32_t* bad, uint32_t* newline)
+{
+    __m256i low6 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tables->low6));
+    __m256i low7 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tables->low7));
+    __m256i line_code = _mm256_set1_epi8((char)FILTER_NEWLINE);
+    for (size_t b = 0; b < blocks; b++, p += 32)
+    {
+        __m256i code = side_codes_avx2(_mm256_loadu_si256((const __m256i*)p), low6, low7);
+        __m256i previous = side_codes_avx2(_mm256_loadu_si256((const __m256i*)(p - 1)), low6, low7);
+        __m256i is_line = _mm256_cmpeq_epi8(code, line_code);
+        __m256i reject = _mm256_or_si256(_mm256_cmpeq_epi8(code, _mm256_setzero_si256()),
+                                         _mm256_andnot_si256(is_line, _mm256_cmpeq_epi8(code, previous)));
+        bad[b] = (uint32_t)_mm256_movemask_epi8(reject);
+        newline[b] = (uint32_t)_mm256_movemask_epi8(is_line);
+    }
+}
+
+__attribute__((target("ssse3")))
+static __m128i side_codes_ssse3(__m128i bytes, __m128i low6, __m128i low7)
+{
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i low = _mm_and_si128(bytes, nibble);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+    __m128i code6 = _mm_and_si128(_mm_shuffle_epi8(low6, low), _mm_cmpeq_epi8(high, _mm_set1_epi8(6)));
+    __m128i code7 = _mm_and_si128(_mm_shuffle_epi8(low7, low), _mm_cmpeq_epi8(high, _mm_set1_epi8(7)));
+    __m128i line = _mm_and_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')),
+                                 _mm_set1_epi8((char)FILTER_NEWLINE));
+    return _mm_or_si128(_mm_or_si128(code6, code7), line);
+}
+
+__attribute__((target("ssse3")))
+void classify_blocks_ssse3(const char* p, size_t blocks, const filter_tables* tables,
+                           uint32_t* bad, uint32_t* newline)
+{
+    __m128i low6 = _mm_loadu_si128((const __m128i*)tables->low6);
+    __m128i low7 = _mm_loadu_si128((const __m128i*)tables->low7);
+    __m128i line_code = _mm_set1_epi8((char)FILTER_NEWLINE);
+    for (size_t b = 0; b < blocks * 2; b++, p += 16)
+    {
+        __m128i code = side_codes_ssse3(_mm_loadu_si128((const __m128i*)p), low6, low7);
+        __m128i previous = side_codes_ssse3(_mm_loadu_si128((const __m128i*)(p - 1)), low6, low7);
+        __m128i is_line = _mm_cmpeq_epi8(code, line_code);
+        __m128i reject = _mm_or_si128(_mm_cmpeq_epi8(code, _mm_setzero_si128()),
+                                      _mm_andnot_si128(is_line, _mm_cmpeq_epi8(code, previous)));
+        uint32_t shift = (b & 1) * 16;
+        if (shift == 0)
         {
-            first_char = *ch_ptr;
-            new_line = false;
-            if (last_char && last_char != first_char)
+            bad[b / 2] = 0;
+            newline[b / 2] = 0;
+        }
+        bad[b / 2] |= (uint32_t)_mm_movemask_epi8(reject) << shift;
+        newline[b / 2] |= (uint32_t)_mm_movemask_epi8(is_line) << shift;
+    }
+}
+#endif
+
+typedef void (*classify_func)(const char*, size_t, const filter_tables*, uint32_t*, uint32_t*);
+
+classify_func pick_classifier(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    return classify_blocks_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+    return classify_blocks_ssse3;
+#endif
+    return classify_blocks_scalar;
+}
+
+void push_view(word_view** words, size_t* capacity, size_t* count, const char* start, size_t length)
+{
+    if (*count == *capacity)
+    {
+        *capacity *= 2;
+        word_view* new_words = realloc(*words, *capacity * sizeof(word_view));
+        if (new_words == NULL)
+        {
+            perror("Unable to reallocate candidates");
+            exit(1);
+        }
+        *words = new_words;
+    }
+    (*words)[*count].start = start;
+    (*words)[*count].length = length;
+    (*count)++;
+}
+
+// Views of every word in text (one per line) that can be traced on the
+// board. The bulk of the text is classified 32 bytes at a time; the first
+// and last partial blocks go through a padded copy.
+word_view* filter_playable(const board* file_board, const char* text, size_t length, size_t* count)
+{
+    filter_tables tables;
+    build_filter_tables(file_board, &tables);
+    classify_func classify = pick_classifier();
+    size_t capacity = 1024;
+    word_view* words = malloc(capacity * sizeof(word_view));
+    uint32_t* bad = malloc(FILTER_SPAN * sizeof(uint32_t));
+    uint32_t* newline = malloc(FILTER_SPAN * sizeof(uint32_t));
+    if (words == NULL || bad == NULL || newline == NULL)
+    {
+        perror("Unable to allocate filter buffers");
+        exit(1);
+    }
+    *count = 0;
+    size_t word_start = 0;
+    bool word_bad = false;
+    // Block 0 and the tail are copied into a padded buffer with a leading
+    // newline so that every block can look one byte back
+    char edge[1 + 32];
+    size_t position = 0;
+    while (position < length)
+    {
+        size_t blocks;
+        const char* source;
+        if (position == 0 || length - position < 32)
+        {
+            size_t take = length - position < 32 ? length - position : 32;
+            edge[0] = position == 0 ? '\n' : text[position - 1];
+            memcpy(edge + 1, text + position, take);
+            memset(edge + 1 + take, '\n', 32 - take);
+            source = edge + 1;
+            blocks = 1;
+            classify_blocks_scalar(source, 1, &tables, bad, newline);
+        }
+        else
+        {
+            blocks = (length - position) / 32;
+            if (blocks > FILTER_SPAN)
+            blocks = FILTER_SPAN;
+            source = text + position;
+            classify(source, blocks, &tables, bad, newline);
+        }
+        for (size_t b = 0; b < blocks; b++)
+        {
+            uint32_t lines = newline[b];
+            uint32_t rejected = bad[b];
+            size_t block_start = position + b * 32;
+            while (lines != 0)
             {
-                printf("First letter of word does not match last letter of previous word\n");
-                exit(0);
+                int bit = __builtin_ctz(lines);
+                uint32_t before = bit == 0 ? 0 : (rejected & ((1u << bit) - 1));
+                size_t end = block_start + bit;
+                if (end > length)
+                end = length;
+                if (!word_bad && before == 0 && end > word_start)
+                push_view(&words, &capacity, count, text + word_start, end - word_start);
+                word_start = end + 1;
+                if (end == length)
+                break;
+                word_bad = false;
+                rejected &= ~((2u << bit) - 1);
+                lines &= lines - 1;
             }
+            if (rejected != 0)
+            word_bad = true;
         }
-        if (*ch_ptr >= 'a' && *ch_ptr <= 'z')
+        position += blocks * 32;
+    }
+    // A last word without a line break, when the text fills whole blocks
+    if (!word_bad && word_start < length)
+    push_view(&words, &capacity, count, text + word_start, length - word_start);
+    free(bad);
+    free(newline);
+    return words;
+}
+
+// Print the playable words of the dictionary, one per line
+int print_candidates(const board* file_board, const dictionary* dict)
+{
+    size_t count;
+    word_view* words = filter_playable(file_board, dict->base, dict->base_length, &count);
+    for (size_t i = 0; i < count; i++)
+    {
+        fwrite(words[i].start, 1, words[i].length, stdout);
+        putchar('\n');
+    }
+    free(words);
+    return 0;
+}
+
+// A dictionary word that can be traced on the board, reduced to what the
+// search needs: its end letters and the set of letters it covers
+typedef struct
+{
+    uint32_t offset;
+    uint32_t length;
+    uint32_t mask;
+    uint8_t first;
+    uint8_t last;
+} candidate;
+
+// One BFS node: last letter and covered letters, plus how it was reached
+typedef struct
+{
+    uint32_t key;
+    uint32_t parent;
+    uint32_t word;
+} solve_state;
+
+int compare_candidate(const void* a, const void* b)
+{
+    const candidate* x = a;
+    const candidate* y = b;
+    if (x->first != y->first)
+    return x->first - y->first;
+    if (x->last != y->last)
+    return x->last - y->last;
+    if (x->mask != y->mask)
+    return x->mask < y->mask ? -1 : 1;
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+// Keep one (shortest) word per first letter, last letter and letter set,
+// sorted so that words starting with each letter are contiguous
+candidate* collect_candidates(const board* file_board, const dictionary* dict, uint32_t* count)
+{
+    size_t playable;
+    word_view* views = filter_playable(file_board, dict->base, dict->base_length, &playable);
+    candidate* words = malloc((playable + 1) * sizeof(candidate));
+    if (words == NULL)
+    {
+        perror("Unable to allocate candidates");
+        exit(1);
+    }
+    for (size_t i = 0; i < playable; i++)
+    {
+        candidate* word = &words[i];
+        word->offset = views[i].start - dict->base;
+        word->length = views[i].length;
+        word->mask = 0;
+        for (size_t j = 0; j < views[i].length; j++)
+        word->mask |= 1u << (views[i].start[j] - 'a');
+        word->first = views[i].start[0] - 'a';
+        word->last = views[i].start[views[i].length - 1] - 'a';
+    }
+    *count = playable;
+    free(views);
+    if (*count > 0)
+    qsort(words, *count, sizeof(candidate), compare_candidate);
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < *count; i++)
+    {
+        if (unique > 0 && words[unique - 1].first == words[i].first &&
+            words[unique - 1].last == words[i].last && words[unique - 1].mask == words[i].mask)
+        continue;
+        words[unique++] = words[i];
+    }
+    *count = unique;
+    return words;
+}
+
+// Visited set over state keys (last letter << 26 | mask), stored as key + 1
+typedef struct
+{
+    uint32_t* keys;
+    uint32_t mask;
+    uint32_t count;
+} state_set;
+
+bool state_set_add(state_set* set, uint32_t key)
+{
+    if (2 * (set->count + 1) > set->mask + 1)
+    {
+        uint32_t new_size = 2 * (set->mask + 1);
+        uint32_t* new_keys = calloc(new_size, sizeof(uint32_t));
+        if (new_keys == NULL)
         {
-            alpha_set_std_input[*ch_ptr - 'a']++;
+            perror("Unable to allocate state table");
+            exit(1);
         }
-        else
+        for (uint32_t i = 0; i <= set->mask; i++)
         {
-            printf("Input not from a to z\n");
+            if (set->keys[i] == 0)
+            continue;
+            uint32_t slot = (set->keys[i] * 2654435761u) & (new_size - 1);
+            while (new_keys[slot] != 0)
+            slot = (slot + 1) & (new_size - 1);
+            new_keys[slot] = set->keys[i];
+        }
+        free(set->keys);
+        set->keys = new_keys;
+        set->mask = new_size - 1;
+    }
+    uint32_t stored = key + 1;
+    uint32_t slot = (stored * 2654435761u) & set->mask;
+    while (set->keys[slot] != 0)
+    {
+        if (set->keys[slot] == stored)
+        return false;
+        slot = (slot + 1) & set->mask;
+    }
+    set->keys[slot] = stored;
+    set->count++;
+    return true;
+}
+
+typedef struct
+{
+    const candidate* words;
+    solve_state* states;
+    size_t capacity;
+    uint32_t total;
+    state_set seen;
+    uint32_t goal;
+} search;
+
+// Follow word w from a state covering mask; returns true once the board is covered
+bool extend_state(search* s, uint32_t parent, uint32_t mask, uint32_t w)
+{
+    uint32_t next_mask = mask | s->words[w].mask;
+    uint32_t key = (uint32_t)s->words[w].last << 26 | next_mask;
+    if (!state_set_add(&s->seen, key))
+    return false;
+    if (s->total == s->capacity)
+    {
+        s->capacity *= 2;
+        solve_state* new_states = realloc(s->states, s->capacity * sizeof(solve_state));
+        if (new_states == NULL)
+        {
+            perror("Unable to reallocate search state");
             exit(1);
         }
-        last_char = *ch_ptr;
+        s->states = new_states;
     }
+    s->states[s->total].key = key;
+    s->states[s->total].parent = parent;
+    s->states[s->total].word = w;
+    s->total++;
+    return next_mask == s->goal;
+}
 
+// Breadth-first search over (last letter, covered letters) states, so the
+// first state covering the whole board ends a chain with the fewest words.
+// The visited set memoizes states already reached by a shorter chain, so
+// the search visits at most 12 * 2^12 states and always runs to the end.
+int solve(const board* file_board, const dictionary* dict)
+{
+    uint32_t count;
+    candidate* words = collect_candidates(file_board, dict, &count);
+    uint32_t by_first[27] = {0};
+    for (uint32_t i = 0; i < count; i++)
+    by_first[words[i].first + 1]++;
     for (int i = 0; i < 26; i++)
+    by_first[i + 1] += by_first[i];
+
+    search s = {words, malloc(1024 * sizeof(solve_state)), 1024, 0,
+                {calloc(1024, sizeof(uint32_t)), 1023, 0}, file_board->letters};
+    if (s.states == NULL || s.seen.keys == NULL)
+    {
+        perror("Unable to allocate search state");
+        exit(1);
+    }
+    bool found = false;
+    for (uint32_t w = 0; w < count && !found; w++)
+    found = extend_state(&s, UINT32_MAX, 0, w);
+    uint32_t level_start = 0;
+    while (!found && level_start < s.total)
     {
-        if (alpha_set_std_input[i] != 0 && alpha_set[i] == 0)
+        uint32_t level_end = s.total;
+        for (uint32_t i = level_start; i < level_end && !found; i++)
         {
-            printf("Used a letter not present on the board\n");
-            exit(0);
+            uint32_t key = s.states[i].key;
+            uint32_t last = key >> 26;
+            for (uint32_t w = by_first[last]; w < by_first[last + 1] && !found; w++)
+            found = extend_state(&s, i, key & ((1u << 26) - 1), w);
         }
-        if (alpha_set_std_input[i] == 0 && alpha_set[i] != 0)
+        level_start = level_end;
+    }
+
+    if (!found)
+    printf("No solution\n");
+    else
+    {
+        uint32_t length = 0;
+        for (uint32_t i = s.total - 1; i != UINT32_MAX; i = s.states[i].parent)
+        length++;
+        uint32_t* chain = malloc(length * sizeof(uint32_t));
+        if (chain == NULL)
         {
-            printf("Not all letters used\n");
-            exit(0);
+            perror("Unable to allocate solution");
+            exit(1);
         }
+        uint32_t position = length;
+        for (uint32_t i = s.total - 1; i != UINT32_MAX; i = s.states[i].parent)
+        chain[--position] = s.states[i].word;
+        for (uint32_t i = 0; i < length; i++)
+        printf("%.*s\n", (int)words[chain[i]].length, dict->base + words[chain[i]].offset);
+        free(chain);
     }
-    free(alpha_set_std_input);
-    int letter_row[26];
-    memset(letter_row, -1, sizeof(letter_row));
-    parse_board(file_board, letter_row);
-    check_conseq(std_input, letter_row);
+    free(s.seen.keys);
+    free(s.states);
+    free(words);
     return 0;
 }
 
+// Workers shared by --serve -j N. Each batch is a list of frames whose
+// verdicts are written to the matching slot, so output keeps input order.
+typedef struct worker_pool worker_pool;
 
-char** split_lines(char *buffer, int *count)
+// A thread of the pool with its own scratch arena, which every
+// submission resets, so checking one never calls malloc
+typedef struct
 {
-    char** lines = NULL;
-    int capacity = 0;
-    *count = 0;
-    char* line = strtok(buffer, "\n");
-    while (line)
+    worker_pool* pool;
+    pthread_t thread;
+    arena scratch;
+} worker;
+
+struct worker_pool
+{
+    const board* file_board;
+    const dictionary* dict;
+    const word_view* frames;
+    verdict* verdicts;
+    size_t count;
+    atomic_size_t next;
+    unsigned generation;
+    unsigned busy;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    worker* threads; // workers threads, then the calling thread
+    int workers;
+};
+
+void run_batch(worker_pool* pool, arena* scratch)
+{
+    size_t first;
+    while ((first = atomic_fetch_add(&pool->next, JOB_GRAIN)) < pool->count)
+    {
+        size_t last = first + JOB_GRAIN < pool->count ? first + JOB_GRAIN : pool->count;
+        for (size_t i = first; i < last; i++)
+        pool->verdicts[i] = validate_submission(pool->frames[i].start, pool->frames[i].length,
+                                                pool->file_board, pool->dict, scratch);
+    }
+}
+
+void* worker_main(void* arg)
+{
+    worker* self = arg;
+    worker_pool* pool = self->pool;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
     {
-        if (*count >= capacity)
+        while (pool->generation == seen && !pool->stop)
+        pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
+        break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        run_batch(pool, &self->scratch);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void start_pool(worker_pool* pool, int jobs, const board* file_board, const dictionary* dict,
+                arena* memory)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->file_board = file_board;
+    pool->dict = dict;
+    pool->workers = jobs - 1; // The calling thread takes part in every batch
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->threads = arena_alloc(memory, jobs * sizeof(worker));
+    for (int i = 0; i < jobs; i++)
+    {
+        pool->threads[i].pool = pool;
+        arena_init(&pool->threads[i].scratch, READ_CHUNK);
+    }
+    for (int i = 0; i < pool->workers; i++)
+    {
+        if (pthread_create(&pool->threads[i].thread, NULL, worker_main, &pool->threads[i]) != 0)
         {
-            capacity = (capacity == 0) ? 1 : capacity * 2;
-            lines = realloc(lines, capacity * sizeof(char*));
+            perror("Unable to create worker thread");
+            exit(1);
         }
-        lines[*count] = line;
-        (*count)++;
-        line = strtok(NULL, "\n");
     }
-    return lines;
 }
 
-int binary_search(char **array, int size, const char *key)
+void validate_batch(worker_pool* pool, const word_view* frames, verdict* verdicts, size_t count)
 {
-    int low = 0, high = size - 1;
-    while (low <= high)
+    pool->frames = frames;
+    pool->verdicts = verdicts;
+    pool->count = count;
+    atomic_store(&pool->next, 0);
+    arena* own = &pool->threads[pool->workers].scratch;
+    if (pool->workers == 0 || count <= JOB_GRAIN)
     {
-        int mid = low + (high - low) / 2;
-        int res = strcmp(array[mid], key);
-        if (res == 0)
-        return 1;
-        else if (res < 0)
-        low = mid + 1;
-        else
-        high = mid - 1;
+        run_batch(pool, own);
+        return;
     }
+    pthread_mutex_lock(&pool->lock);
+    pool->busy = pool->workers;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    run_batch(pool, own);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void stop_pool(worker_pool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workers; i++)
+    pthread_join(pool->threads[i].thread, NULL);
+    for (int i = 0; i <= pool->workers; i++)
+    arena_free(&pool->threads[i].scratch);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+}
+
+size_t serve_buffer_size(int jobs)
+{
+    return jobs > 1 ? READ_CHUNK * 16 : READ_CHUNK;
+}
+
+// Whether a read() of fd would return at once: data, or end of file
+bool input_waiting(int fd)
+{
+    struct pollfd poller = {.fd = fd, .events = POLLIN};
+    return poll(&poller, 1, 0) > 0;
+}
+
+// Validate NUL-separated submissions from stdin, one verdict line each.
+// Reads add up while more input is already waiting, until the buffer is
+// full or the input ends; the complete frames then form one batch that
+// the pool checks in parallel before the verdicts are printed in input
+// order. A client waiting on each verdict still gets it straight away.
+int serve(const board* file_board, const dictionary* dict, int jobs, arena* memory)
+{
+    worker_pool pool;
+    start_pool(&pool, jobs, file_board, dict, memory);
+    size_t frame_capacity = SERVE_FRAMES;
+    word_view* frames = arena_alloc(memory, frame_capacity * sizeof(word_view));
+    verdict* verdicts = arena_alloc(memory, frame_capacity * sizeof(verdict));
+    size_t size = serve_buffer_size(jobs);
+    size_t length = 0;
+    size_t scanned = 0; // Bytes known not to end a frame
+    char* buffer = arena_alloc(memory, size);
+    while (1)
+    {
+        // The buffer is the newest allocation, so it usually grows in place
+        if (length == size)
+        {
+            buffer = arena_resize(memory, buffer, size, size * 2);
+            size *= 2;
+        }
+        ssize_t bytes = read(STDIN_FILENO, buffer + length, size - length);
+        if (bytes < 0)
+        {
+            perror("Unable to read file");
+            exit(1);
+        }
+        // A final submission does not need a terminating NUL
+        bool eof = bytes == 0;
+        length += bytes;
+        if (!eof && length < size && input_waiting(STDIN_FILENO))
+        continue;
+
+        size_t start = 0;
+        size_t count = 0;
+        while (start < length)
+        {
+            char* frame_end = memchr(buffer + scanned, '\0', length - scanned);
+            if (frame_end == NULL && !eof)
+            break;
+            size_t end = frame_end ? (size_t)(frame_end - buffer) : length;
+            if (count == frame_capacity)
+            {
+                frames = arena_resize(memory, frames, frame_capacity * sizeof(word_view),
+                                      2 * frame_capacity * sizeof(word_view));
+                verdicts = arena_resize(memory, verdicts, frame_capacity * sizeof(verdict),
+                                        2 * frame_capacity * sizeof(verdict));
+                frame_capacity *= 2;
+            }
+            frames[count].start = buffer + start;
+            frames[count].length = end - start;
+            count++;
+            start = end + 1;
+            scanned = start;
+        }
+
+        // Answer every complete frame before blocking on the next read
+        validate_batch(&pool, frames, verdicts, count);
+        for (size_t i = 0; i < count; i++)
+        puts(verdict_messages[verdicts[i]]);
+        fflush(stdout);
+        if (eof)
+        break;
+        memmove(buffer, buffer + start, length - start);
+        length -= start;
+        scanned = length;
+    }
+    stop_pool(&pool);
     return 0;
 }
 
+// Size of the arena backing a run: the hash table of a text dictionary,
+// then either the stdin chunk or the --serve tables, and room for a word
+// spanning chunks. Solving allocates on its own.
+size_t run_arena_size(size_t dict_lines, bool serve_mode, int jobs)
+{
+    size_t size = ARENA_ROUND(slot_count_for(dict_lines) * sizeof(dict_slot)) + 2 * READ_CHUNK;
+    if (serve_mode)
+    size += ARENA_ROUND(jobs * sizeof(worker)) + serve_buffer_size(jobs) +
+        ARENA_ROUND(SERVE_FRAMES * sizeof(word_view)) + ARENA_ROUND(SERVE_FRAMES * sizeof(verdict));
+    return size;
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    if (argc == 4 && strcmp(argv[1], "--build-index") == 0)
     {
-        fprintf(stderr, "Wrong number of arguments\n");
-        exit(1);
+        build_index(argv[2], argv[3]);
+        exit(0);
+    }
+    int arg = 1;
+    bool serve_mode = false;
+    bool solve_mode = false;
+    bool candidates_mode = false;
+    long jobs = 1;
+    if (argc > arg && strcmp(argv[arg], "--solve") == 0)
+    {
+        solve_mode = true;
+        arg++;
+    }
+    else if (argc > arg && strcmp(argv[arg], "--candidates") == 0)
+    {
+        candidates_mode = true;
+        arg++;
     }
-    char* file_board = read_file_dynamically(argv[1]);
-    char *file_dict = read_file_dynamically(argv[2]);
-    char* std_input = read_stdin();
-    int* alpha_set = check_board(file_board);
-    check_input(std_input, file_board, alpha_set);
-    int dict_size, std_input_size;
-    char** dict_words = split_lines(file_dict, &dict_size);
-    char** input_words = split_lines(std_input, &std_input_size);
-    for (int i = 0; i < std_input_size; i++) {
-        if (!(binary_search(dict_words, dict_size, input_words[i])))
+    else if (argc > arg && strcmp(argv[arg], "--serve") == 0)
+    {
+        serve_mode = true;
+        arg++;
+        if (argc > arg + 1 && strcmp(argv[arg], "-j") == 0)
         {
-            printf("Word not found in dictionary\n");
-            exit(0);
+            char* end;
+            jobs = strtol(argv[arg + 1], &end, 10);
+            if (*end != '\0' || jobs < 1 || jobs > MAX_JOBS)
+            {
+                fprintf(stderr, "Invalid number of jobs\n");
+                exit(1);
+            }
+            arg += 2;
         }
     }
-    free(alpha_set);
-    free(file_dict);
-    free(std_input);
-    free(dict_words);
-    free(input_words);
-    printf("Correct\n");
-    exit(0);
+    if (argc - arg != 2)
+    {
+        fprintf(stderr, "Wrong number of arguments\n");
+        exit(1);
+    }
+    text_buffer file_board = read_file_dynamically(argv[arg]);
+    dictionary dict = load_dictionary(argv[arg + 1]);
+    board parsed_board;
+    verdict result = check_board(file_board.data, file_board.length, &parsed_board);
+    if (result != VERDICT_CORRECT)
+    {
+        printf("%s\n", verdict_messages[result]);
+        exit(verdict_exit_code(result));
+    }
+    if (candidates_mode)
+    {
+        print_candidates(&parsed_board, &dict);
+        free_text(&file_board);
+        free_dictionary(&dict);
+        exit(0);
+    }
+    if (solve_mode)
+    {
+        solve(&parsed_board, &dict);
+        free_text(&file_board);
+        free_dictionary(&dict);
+        exit(0);
+    }
+    size_t dict_lines = dict.slots == NULL ? count_lines(dict.base, dict.base_length) : 0;
+    arena memory;
+    arena_init(&memory, run_arena_size(dict_lines, serve_mode, jobs));
+    if (dict.slots == NULL)
+    build_text_dictionary(&dict, dict_lines, &memory);
+    if (serve_mode)
+    {
+        serve(&parsed_board, &dict, jobs, &memory);
+        arena_free(&memory);
+        free_text(&file_board);
+        free_dictionary(&dict);
+        exit(0);
+    }
+    result = validate_stream(STDIN_FILENO, &parsed_board, &dict, &memory);
+    arena_free(&memory);
+    free_text(&file_board);
+    free_dictionary(&dict);
+    printf("%s\n", verdict_messages[result]);
+    exit(verdict_exit_code(result));
 }
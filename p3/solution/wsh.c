@@ -1,11 +1,29 @@
 #include "wsh.h"
 
 // static char* path_variable;
-static char** history = NULL; // Array to store history commands
+static char* history[MAXIMUM_HISTORY]; // Ring of history commands
+static unsigned history_start = 0; // Slot of the oldest command
 static unsigned history_count = 0; // Current number of commands in history
 static unsigned history_capacity = DEFAULT_HISTORY_SIZE; // Current history capacity
-int stdin_backup, stdout_backup, stderr_backup; // Backup std file
+static int history_fd = -1; // ~/.wsh_history, interactive shells only
+static char* history_map = NULL; // Its contents at startup, until loaded
+static size_t history_map_length = 0;
+static size_t history_file_lines = 0; // Lines in the history file
+static Redirection redirection = {-1, {-1, -1}}; // Redirection of the current command
 static int last_exit_status = 0;
+static CommandHash* command_hash[COMMAND_HASH_SIZE]; // Commands already found on PATH
+static Job* jobs = NULL; // Background jobs, slot i has id i + 1
+static int job_slots = 0; // JOB_SLOTS, or N for wsh -j N if more
+static int job_epoll = -1; // pidfds of job stages and job output pipes
+static int running_job_count = 0; // Jobs with stages not reaped yet
+static int polled_stages = 0; // Stages without a pidfd
+static Job* output_job = NULL; // The job writing its output through
+static GlobDirectory glob_cache[GLOB_CACHE_SIZE]; // Listings of globbed directories
+static jmp_buf* syntax_recovery = NULL; // Set while the prompt compiles a line
+static int parallel_jobs = 0; // wsh -j N: lines run as up to N jobs
+static int script_cache = 0; // WSH_CACHE: keep compiled batch scripts in .wshc files
+static int profile_fd = -1; // WSH_PROFILE: where exec_fork() records each command
+static int profile_json = 0;
 
 int determine_annotation(char* command_input)
 {
@@ -14,154 +32,467 @@ int determine_annotation(char* command_input)
     return ((*command_input == '#') || (*command_input == '\0')); // The whole line is space or started with #
 }
 
-void restore_redirection(void)
+void redirect_descriptors(const Redirection* redirection)
 {
-    // Restore stdin
-    dup2(stdin_backup, 0);
-    // Restore stdout
-    dup2(stdout_backup, 1);
-    // Restore stderr
-    dup2(stderr_backup, 2);
+    for (int i = 0; i < 2; i++)
+    if (redirection->fd >= 0 && redirection->targets[i] >= 0)
+    dup2(redirection->fd, redirection->targets[i]);
 }
 
+// Where a builtin's output goes: the redirection file if it replaces
+// stdout, else stdout. Builtins write nothing else.
+int built_in_output_fd(const Redirection* redirection)
+{
+    if (redirection->fd >= 0 && (redirection->targets[0] == 1 || redirection->targets[1] == 1))
+    return redirection->fd;
+    return 1;
+}
 
+// Builtin output is collected in a Writer and written in large bursts.
+// stdout is flushed first, so a pending prompt still comes out before.
+void writer_flush(Writer* out)
+{
+    fflush(stdout);
+    if (out->used > 0)
+    write_all(out->fd, out->buffer, out->used);
+    out->used = 0;
+}
 
-char* parse_and_execute(char *input) {
-    char *command = NULL;
-    char *redirect = NULL;
-    int type = 0;
-    int fd;
-    int redirect_fd = 1;  // 默认重定向的文件描述符是标准输出
+void writer_put(Writer* out, const char* data, size_t length)
+{
+    if (out->used + length > WRITER_SIZE)
+    writer_flush(out);
+    if (length > WRITER_SIZE)
+    {
+        write_all(out->fd, data, length);
+        return;
+    }
+    memcpy(out->buffer + out->used, data, length);
+    out->used += length;
+}
+
+void writer_printf(Writer* out, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    size_t space = WRITER_SIZE - out->used;
+    int length = vsnprintf(out->buffer + out->used, space, format, args);
+    va_end(args);
+    if (length < 0)
+    return;
+    if ((size_t)length < space)
+    {
+        out->used += length;
+        return;
+    }
+    writer_flush(out);
+    va_start(args, format);
+    if (length < WRITER_SIZE)
+    out->used = vsnprintf(out->buffer, WRITER_SIZE, format, args);
+    else
+    vdprintf(out->fd, format, args);
+    va_end(args);
+}
 
-    if (stdin_backup == -1)
-        stdin_backup = dup(0);  // Backup stdin
-    if (stdout_backup == -1)
-        stdout_backup = dup(1); // Backup stdout
-    if (stderr_backup == -1)
-        stderr_backup = dup(2); // Backup stderr
+// Run a builtin in the shell with its output going to fd
+int run_built_in(built_in_func built_in, char** args, int fd)
+{
+    Writer out;
+    out.fd = fd;
+    out.used = 0;
+    int result = built_in(args, &out);
+    writer_flush(&out);
+    return result;
+}
+
+void close_redirection(void)
+{
+    if (redirection.fd >= 0)
+    close(redirection.fd);
+    redirection.fd = -1;
+    redirection.targets[0] = -1;
+    redirection.targets[1] = -1;
+}
+
+// Find the redirection in input and cut it off the command, which is
+// returned; type is 0 if there is none, else as in open_redirection()
+char* scan_redirection(char *input, int* type, int* redirect_fd, char** path) {
+    char *redirect = NULL;
+    *type = 0;
+    *redirect_fd = 1;  // 默认重定向的文件描述符是标准输出
 
     // Redirection signal
-    if ((redirect = strstr(input, "<")) != NULL) {
-        type = 1;
-    } else if ((redirect = strstr(input, ">>")) != NULL) {
-        type = 3;
-    } else if ((redirect = strstr(input, ">")) != NULL) {
-        type = 2;
-    } else if ((redirect = strstr(input, "&>>")) != NULL) {
-        type = 5;
-    } else if ((redirect = strstr(input, "&>")) != NULL) {
-        type = 4;
+    if ((redirect = find_outside_substitution(input, "<")) != NULL) {
+        *type = 1;
+    } else if ((redirect = find_outside_substitution(input, ">>")) != NULL) {
+        *type = 3;
+    } else if ((redirect = find_outside_substitution(input, ">")) != NULL) {
+        *type = 2;
+    } else if ((redirect = find_outside_substitution(input, "&>>")) != NULL) {
+        *type = 5;
+    } else if ((redirect = find_outside_substitution(input, "&>")) != NULL) {
+        *type = 4;
     }
 
     // Dealing with number redirection
     if (redirect && redirect > input && *(redirect - 1) >= '0' && *(redirect - 1) <= '9') {
-        redirect_fd = *(redirect - 1) - '0';  // Translate it to int
+        *redirect_fd = *(redirect - 1) - '0';  // Translate it to int
         *(redirect - 1) = '\0';  // Delete it
     }
 
     if (redirect) {
         *redirect = '\0';  // Split the command by \0
-        redirect += (type == 3 || type == 4) ? 2 : (type == 5 ? 3 : 1);  // Jump over the redirection signal
+        redirect += (*type == 3 || *type == 4) ? 2 : (*type == 5 ? 3 : 1);  // Jump over the redirection signal
     }
+    *path = redirect;
 
     // This is the real command
-    command = input;
+    return input;
+}
+
+// Open the file of a scanned redirection. Nothing is applied here: spawned
+// commands get it as file actions, builtins write to it through their
+// Writer, so the shell's descriptors stay untouched.
+void open_redirection(int type, int redirect_fd, const char* path, Redirection* redirection) {
+    int fd = -1;
+
+    redirection->fd = -1;
+    redirection->targets[0] = -1;
+    redirection->targets[1] = -1;
 
     if (type == 1) {
         // Rewrite stdin
-        fd = open(redirect, O_RDONLY);
-        if (fd < 0) {
-            last_exit_status = -1;
-            exit(-1);
-        }
-        dup2(fd, 0);
-        close(fd);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        redirection->targets[0] = 0;
     } else if (type == 2) {
         // Rewrite stdout
-        fd = open(redirect, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd < 0) {
-            last_exit_status = -1;
-            exit(-1);
-        }
-        dup2(fd, redirect_fd);  // redirect to special file
-        close(fd);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        redirection->targets[0] = redirect_fd;  // redirect to special file
     } else if (type == 3) {
         // Add to stdout
-        fd = open(redirect, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd < 0) {
-            last_exit_status = -1;
-            exit(-1);
-        }
-        dup2(fd, redirect_fd);  // redirect to special file
-        close(fd);
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        redirection->targets[0] = redirect_fd;  // redirect to special file
     } else if (type == 4) {
         // Rewrite stderr and stdout
-        fd = open(redirect, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd < 0) {
-            last_exit_status = -1;
-            exit(-1);
-        }
-        dup2(fd, 1);
-        dup2(fd, 2);
-        close(fd);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        redirection->targets[0] = 1;
+        redirection->targets[1] = 2;
     } else if (type == 5) {
         // Add to stderr and stdout
-        fd = open(redirect, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd < 0) {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        redirection->targets[0] = 1;
+        redirection->targets[1] = 2;
+    }
+    if (type != 0 && fd < 0) {
+        last_exit_status = -1;
+        exit(-1);
+    }
+    redirection->fd = fd;
+}
+
+
+// Per-command memory: a chain of blocks, newest first. Everything a line
+// allocates (argv, expanded tokens) goes here and is dropped at once by
+// arena_reset() before the next line.
+void* arena_alloc(size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock* block = command_arena;
+    if (block == NULL || block->capacity - block->used < size)
+    {
+        size_t capacity = block != NULL ? block->capacity * 2 : ARENA_BLOCK_SIZE;
+        while (capacity < size)
+        capacity *= 2;
+        ArenaBlock* next = malloc(sizeof(ArenaBlock) + capacity);
+        if (next == NULL)
+        {
+            // perror("Malloc space for arena failed");
             last_exit_status = -1;
             exit(-1);
         }
-        dup2(fd, 1);
-        dup2(fd, 2);
-        close(fd);
+        next->previous = block;
+        next->capacity = capacity;
+        next->used = 0;
+        command_arena = block = next;
+    }
+    void* memory = (char*)(block + 1) + block->used;
+    block->used += size;
+    return memory;
+}
+
+char* arena_copy(const char* text, size_t length)
+{
+    char* copy = arena_alloc(length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Extend memory, the newest allocation, in place if its block has room,
+// else move it
+void* arena_grow(void* memory, size_t old_size, size_t new_size)
+{
+    ArenaBlock* block = command_arena;
+    size_t old_rounded = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t new_rounded = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (block != NULL && (char*)memory + old_rounded == (char*)(block + 1) + block->used &&
+        block->capacity - block->used >= new_rounded - old_rounded)
+    {
+        block->used += new_rounded - old_rounded;
+        return memory;
+    }
+    void* moved = arena_alloc(new_size);
+    memcpy(moved, memory, old_size);
+    return moved;
+}
+
+// Keep only the newest (largest) block
+void arena_reset(void)
+{
+    if (command_arena == NULL)
+    return;
+    ArenaBlock* block = command_arena->previous;
+    while (block != NULL)
+    {
+        ArenaBlock* previous = block->previous;
+        free(block);
+        block = previous;
+    }
+    command_arena->previous = NULL;
+    command_arena->used = 0;
+}
+
+void arena_free(void)
+{
+    arena_reset();
+    free(command_arena);
+    command_arena = NULL;
+}
+
+// Next line from the reader without its newline, NUL-terminated in the
+// reader's buffer until the following call; NULL at EOF. The buffer grows
+// to hold any line and is refilled READ_CHUNK bytes at a time.
+char* read_line(LineReader* reader)
+{
+    while (1)
+    {
+        char* line = reader->buffer + reader->start;
+        char* newline = reader->end > reader->start ?
+            memchr(line, '\n', reader->end - reader->start) : NULL;
+        if (newline != NULL)
+        {
+            *newline = '\0';
+            reader->start = newline + 1 - reader->buffer;
+            return line;
+        }
+        if (reader->eof)
+        {
+            if (reader->start == reader->end)
+            return NULL;
+            reader->buffer[reader->end] = '\0'; // Last line without a newline
+            reader->start = reader->end;
+            return line;
+        }
+        if (reader->start > 0)
+        {
+            memmove(reader->buffer, line, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->capacity - reader->end < READ_CHUNK + 1)
+        {
+            size_t capacity = reader->capacity * 2 > reader->end + READ_CHUNK + 1 ?
+                reader->capacity * 2 : reader->end + READ_CHUNK + 1;
+            char* buffer = realloc(reader->buffer, capacity);
+            if (buffer == NULL)
+            {
+                // perror("Realloc space for input failed");
+                last_exit_status = -1;
+                exit(-1);
+            }
+            reader->buffer = buffer;
+            reader->capacity = capacity;
+        }
+        ssize_t bytes = read(reader->fd, reader->buffer + reader->end, READ_CHUNK);
+        if (bytes < 0 && errno == EINTR)
+        continue;
+        if (bytes <= 0)
+        reader->eof = 1;
+        else
+        reader->end += bytes;
+    }
+}
+
+// The ) that closes the $( at text, or NULL
+char* substitution_end(char* text)
+{
+    int depth = 0;
+    for (char* c = text + 1; *c != '\0'; c++)
+    {
+        if (*c == '(')
+        depth++;
+        else if (*c == ')' && --depth == 0)
+        return c;
+    }
+    return NULL;
+}
+
+// strstr() that skips over $( ), so a | or > inside one belongs to it
+char* find_outside_substitution(char* text, const char* pattern)
+{
+    size_t length = strlen(pattern);
+    for (char* c = text; *c != '\0'; c++)
+    {
+        if (c[0] == '$' && c[1] == '(')
+        {
+            char* end = substitution_end(c);
+            if (end != NULL)
+            {
+                c = end;
+                continue;
+            }
+        }
+        if (strncmp(c, pattern, length) == 0)
+        return c;
+    }
+    return NULL;
+}
+
+// Run command in a forked shell with its stdout on a pipe, read straight
+// into the command arena in large reads; trailing newlines are dropped
+char* capture_command(char* command, size_t* length)
+{
+    int fds[2];
+    size_t capacity = CAPTURE_CHUNK;
+    size_t used = 0;
+    char* output = arena_alloc(capacity + 1);
+    if (pipe2(fds, O_CLOEXEC) != 0)
+    {
+        // perror("pipe failed");
+        *length = 0;
+        output[0] = '\0';
+        return output;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE); // Best effort
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(fds[1], 1);
+        history_fd = -1; // Only the shell's own commands are remembered
+        parallel_jobs = 0;
+        forget_jobs();
+        run_line(command);
+        exit(last_exit_status);
+    }
+    close(fds[1]);
+    while (1)
+    {
+        if (used == capacity)
+        {
+            output = arena_grow(output, capacity + 1, 2 * capacity + 1);
+            capacity *= 2;
+        }
+        ssize_t bytes = read(fds[0], output + used, capacity - used);
+        if (bytes < 0 && errno == EINTR)
+        continue;
+        if (bytes <= 0)
+        break;
+        used += bytes;
     }
+    close(fds[0]);
+    if (pid > 0)
+    wait_for_child(pid, NULL, NULL);
+    while (used > 0 && output[used - 1] == '\n')
+    used--;
+    output[used] = '\0';
+    *length = used;
+    return output;
+}
 
-    return command;
+// Replace every $( ) in token by the output of its command
+char* substitute_commands(char* token)
+{
+    size_t pieces = 0;
+    size_t capacity = 1;
+    for (char* c = token; (c = strstr(c, "$(")) != NULL; c += 2)
+    capacity += 2;
+    char** texts = arena_alloc(capacity * sizeof(char*));
+    size_t* lengths = arena_alloc(capacity * sizeof(size_t));
+    size_t total = 0;
+    char* rest = token;
+    char* start;
+    while ((start = strstr(rest, "$(")) != NULL)
+    {
+        char* end = substitution_end(start);
+        if (end == NULL) // Unbalanced: the rest stays as written
+        break;
+        texts[pieces] = rest;
+        lengths[pieces] = start - rest;
+        total += lengths[pieces++];
+        texts[pieces] = capture_command(arena_copy(start + 2, end - start - 2), &lengths[pieces]);
+        total += lengths[pieces++];
+        rest = end + 1;
+    }
+    texts[pieces] = rest;
+    lengths[pieces] = strlen(rest);
+    total += lengths[pieces++];
+    char* result = arena_alloc(total + 1);
+    size_t used = 0;
+    for (size_t i = 0; i < pieces; i++)
+    {
+        memcpy(result + used, texts[i], lengths[i]);
+        used += lengths[i];
+    }
+    result[used] = '\0';
+    return result;
 }
 
+// Expand a $NAME token, or the $( ) in a token; the result lives in the
+// command arena or is the token itself
 char* replace_vars_in_token(char* token)
 {
+    if (strstr(token, "$(") != NULL)
+    return substitute_commands(token);
     if (token[0] == '$')
     {
         // Get rid of $
         char* var_name = token + 1;
+        if (var_name[0] == '?') // Status of the last command
+        {
+            char status[16];
+            int status_length = snprintf(status, sizeof(status), "%d", last_exit_status & 0xff);
+            size_t suffix_length = strlen(var_name + 1);
+            char* result = arena_alloc(status_length + suffix_length + 1);
+            memcpy(result, status, status_length);
+            memcpy(result + status_length, var_name + 1, suffix_length + 1);
+            return result;
+        }
         
         // Only extract variable name
-        char var_buffer[MAXIMUM_ARGS];
         int i = 0;
         while (var_name[i] && (isalnum(var_name[i]) || var_name[i] == '_')) {
-            var_buffer[i] = var_name[i];
             i++;
         }
-        var_buffer[i] = '\0';  // Split it by adding \0
-        char *var_name_dup = strdup(var_name);  // 跳过 $
-        // Look for variable in environ variable first
-        if (getenv(var_name_dup))
-        {
-            char *env_value = strdup(getenv(var_name_dup));
-            free(var_name_dup);
-            return env_value;
-        }
-        // Look for variable in shell variable
-        ShellVariable* curr = shell_vars;
-        while (curr != NULL)
+        // Look for variable in environ variable first, then in shell variable
+        const char* value = getenv(arena_copy(var_name, i));
+        ShellVariable* var = value == NULL ? get_shell_var(var_name, i) : NULL;
+        if (var != NULL)
+        value = var->value;
+        if (value != NULL)
         {
-            if (strcmp(curr->name, var_buffer) == 0)
-            {
-                // Return value of variable to replace $A
-                char* result = malloc(strlen(curr->value) + strlen(var_name + i) + 1);
-                sprintf(result, "%s%s", curr->value, var_name + i);
-                free(var_name_dup);
-                return result;
-            }
-            curr = curr->next;
+            // Return value of variable to replace $A, keeping what follows the name
+            size_t value_length = strlen(value);
+            size_t suffix_length = strlen(var_name + i);
+            char* result = arena_alloc(value_length + suffix_length + 1);
+            memcpy(result, value, value_length);
+            memcpy(result + value_length, var_name + i, suffix_length + 1);
+            return result;
         }
-        free(var_name_dup);
         // If can not find, return empty string
-        return strdup("");
+        return arena_copy("", 0);
     }
     // If token starts with something other than $，return original token
-    return strdup(token);
+    return token;
 }
 
 char* replace_vars_in_first_token(char* token)
@@ -170,64 +501,263 @@ char* replace_vars_in_first_token(char* token)
     {
         // Get rid of $
         char* var_name = token + 1;
-        // Only extract variable name
-        int i = 0;
         // Look for variable in environ variable
-        char *var_name_dup = strdup(var_name);
-        char *env_value = strdup(getenv("PATH"));
+        char* env_value = getenv("PATH");
         if (env_value != NULL) {
-            char* result = malloc(strlen(env_value) + strlen(var_name + i) + 1);
-            sprintf(result, "%s%s", env_value, var_name + i);
-            free(var_name_dup);
-            free(env_value);
+            size_t env_length = strlen(env_value);
+            size_t rest_length = strlen(var_name);
+            char* result = arena_alloc(env_length + rest_length + 1);
+            memcpy(result, env_value, env_length);
+            memcpy(result + env_length, var_name, rest_length + 1);
             return result;
         }
-        free(env_value);
-        free(var_name_dup);
         // If can not find, return empty string
-        return strdup("");
+        return arena_copy("", 0);
     }
     // If token starts with something other than $，return original token
-    return strdup(token);
+    return arena_copy(token, strlen(token));
 }
 
 
 
 
-char** split_input_to_token(char* command_input)
+// Cut the next space-separated token out of *position; NULL at the end
+char* next_token(char** position)
 {
-    // Split char* to char**
-    char* command_token = strtok(command_input, " ");
-    if (command_token == NULL || *command_token == '\0')
+    char* token = *position;
+    while (*token == ' ')
+    token++;
+    if (*token == '\0')
+    return NULL;
+    char* end = token;
+    while (*end != '\0' && *end != ' ')
     {
-        // printf("No command input\n");
+        char* close = end[0] == '$' && end[1] == '(' ? substitution_end(end) : NULL;
+        end = close != NULL ? close + 1 : end + 1; // $( ) is one token, spaces and all
+    }
+    if (*end != '\0')
+    *end++ = '\0';
+    *position = end;
+    return token;
+}
+
+// Whether a token as written is a glob pattern: a literal * or ?, not
+// part of $( ), $? or $NAME
+int glob_token(char* token)
+{
+    for (char* c = token; *c != '\0'; c++)
+    {
+        if (c[0] == '$')
+        {
+            char* end = c[1] == '(' ? substitution_end(c) : NULL;
+            if (end != NULL)
+            c = end;
+            else if (c[1] == '?')
+            c++;
+            else
+            while (isalnum((unsigned char)c[1]) || c[1] == '_')
+            c++;
+            continue;
+        }
+        if (*c == '*' || *c == '?')
+        return 1;
+    }
+    return 0;
+}
+
+// List path into directory: its names but . and .., sorted, in one
+// malloc'd pool. Returns 0, or -1 if it cannot be read.
+int list_glob_directory(GlobDirectory* directory, const char* path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat statbuf;
+    if (fd < 0 || fstat(fd, &statbuf) != 0)
+    {
+        if (fd >= 0)
+        close(fd);
+        return -1;
+    }
+    char* buffer = arena_alloc(LS_GETDENTS_SIZE);
+    size_t capacity = READ_CHUNK;
+    size_t used = 0;
+    size_t count = 0;
+    char* pool = malloc(capacity);
+    ssize_t bytes;
+    if (pool == NULL)
+    {
+        // perror("Malloc space for glob failed");
+        last_exit_status = -1;
         exit(-1);
     }
-    char** args = malloc(sizeof(char*) * MAXIMUM_ARGS); // Limit the maximum args to 10
-    if (!args)
+    while ((bytes = getdents64(fd, buffer, LS_GETDENTS_SIZE)) > 0)
+    {
+        for (ssize_t offset = 0; offset < bytes; )
+        {
+            struct dirent64* entry = (struct dirent64*)(buffer + offset);
+            offset += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+            size_t length = strlen(entry->d_name) + 1;
+            if (used + length > capacity)
+            {
+                while (used + length > capacity)
+                capacity *= 2;
+                char* grown = realloc(pool, capacity);
+                if (grown == NULL)
+                {
+                    // perror("Realloc space for glob failed");
+                    last_exit_status = -1;
+                    exit(-1);
+                }
+                pool = grown;
+            }
+            memcpy(pool + used, entry->d_name, length);
+            used += length;
+            count++;
+        }
+    }
+    close(fd);
+    char** names = malloc((count + 1) * sizeof(char*));
+    char** scratch = malloc((count + 1) * sizeof(char*));
+    if (names == NULL || scratch == NULL)
     {
-        // perror("Malloc space for args failed");
+        // perror("Malloc space for glob failed");
         last_exit_status = -1;
         exit(-1);
     }
-    int i = 0;
-    args[i++] = command_token;
-    while ((command_token = strtok(NULL, " ")) != NULL)
+    for (size_t i = 0, offset = 0; i < count; i++)
+    {
+        names[i] = pool + offset;
+        offset += strlen(names[i]) + 1;
+    }
+    sort_names(names, count, 0, scratch);
+    free(scratch);
+
+    free(directory->path);
+    free(directory->pool);
+    free(directory->names);
+    directory->path = strdup(path);
+    directory->device = statbuf.st_dev;
+    directory->inode = statbuf.st_ino;
+    directory->mtime = statbuf.st_mtim;
+    directory->pool = pool;
+    directory->names = names;
+    directory->count = count;
+    // A change within the timestamp granularity may not move the mtime,
+    // so a listing that recent is not trusted next time
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if ((now.tv_sec - statbuf.st_mtim.tv_sec) * 1000000000L + now.tv_nsec - statbuf.st_mtim.tv_nsec < GLOB_RACY_NS)
+    directory->mtime.tv_sec = -1;
+    return 0;
+}
+
+// The listing of path, from the cache if the directory is unchanged
+GlobDirectory* glob_directory(const char* path)
+{
+    static unsigned next_slot = 0;
+    struct stat statbuf;
+    if (stat(path, &statbuf) != 0)
+    return NULL;
+    GlobDirectory* directory = NULL;
+    for (int i = 0; i < GLOB_CACHE_SIZE && directory == NULL; i++)
+    if (glob_cache[i].path != NULL && strcmp(glob_cache[i].path, path) == 0)
+    directory = &glob_cache[i];
+    if (directory != NULL && directory->device == statbuf.st_dev &&
+        directory->inode == statbuf.st_ino &&
+        directory->mtime.tv_sec == statbuf.st_mtim.tv_sec &&
+        directory->mtime.tv_nsec == statbuf.st_mtim.tv_nsec)
+    return directory;
+    if (directory == NULL)
+    directory = &glob_cache[next_slot++ % GLOB_CACHE_SIZE];
+    return list_glob_directory(directory, path) == 0 ? directory : NULL;
+}
+
+void free_glob_cache(void)
+{
+    for (int i = 0; i < GLOB_CACHE_SIZE; i++)
+    {
+        free(glob_cache[i].path);
+        free(glob_cache[i].pool);
+        free(glob_cache[i].names);
+    }
+    memset(glob_cache, 0, sizeof(glob_cache));
+}
+
+char** append_arg(char** args, size_t* count, size_t* capacity, char* arg)
+{
+    if (*count + 1 == *capacity)
     {
+        char** grown = arena_alloc(sizeof(char*) * *capacity * 2);
+        memcpy(grown, args, sizeof(char*) * *count);
+        args = grown;
+        *capacity *= 2;
+    }
+    args[(*count)++] = arg;
+    return args;
+}
 
-        char* replaced_token = replace_vars_in_token(command_token);
-        args[i++] = strdup(replaced_token);
-        free(replaced_token);  // Free replace_vars_in_token
+// Append the names matching pattern, sorted, or pattern itself if none
+// does. Only the last path component may hold * or ?; names starting
+// with . only match a pattern that does too.
+char** append_glob(char** args, size_t* count, size_t* capacity, char* pattern)
+{
+    char* slash = strrchr(pattern, '/');
+    size_t prefix_length = slash != NULL ? (size_t)(slash - pattern) + 1 : 0;
+    char* name_pattern = pattern + prefix_length;
+    size_t first = *count;
+    if (strcspn(pattern, "*?") >= prefix_length)
+    {
+        char* path = prefix_length == 0 ? "." : arena_copy(pattern, prefix_length > 1 ? prefix_length - 1 : 1);
+        GlobDirectory* directory = glob_directory(path);
+        for (size_t i = 0; directory != NULL && i < directory->count; i++)
+        {
+            const char* name = directory->names[i];
+            if (fnmatch(name_pattern, name, FNM_PERIOD) != 0)
+            continue;
+            size_t length = strlen(name);
+            char* match = arena_alloc(prefix_length + length + 1);
+            memcpy(match, pattern, prefix_length);
+            memcpy(match + prefix_length, name, length + 1);
+            args = append_arg(args, count, capacity, match);
+        }
+    }
+    if (*count == first)
+    args = append_arg(args, count, capacity, pattern);
+    return args;
+}
 
-        // args[i++] = strdup(replace_vars_in_token(command_token));
+// Split the command on spaces in place, in one pass; argv grows in the
+// command arena as needed
+char** split_input_to_token(char* command_input)
+{
+    size_t capacity = 8;
+    size_t count = 0;
+    char** args = arena_alloc(sizeof(char*) * capacity);
+    char* position = command_input;
+    char* token;
+    while ((token = next_token(&position)) != NULL)
+    {
+        // The command name is used as written
+        if (count == 0)
+        args = append_arg(args, &count, &capacity, token);
+        else if (glob_token(token))
+        args = append_glob(args, &count, &capacity, replace_vars_in_token(token));
+        else
+        args = append_arg(args, &count, &capacity, replace_vars_in_token(token));
+    }
+    if (count == 0)
+    {
+        // printf("No command input\n");
+        exit(-1);
     }
-    args[i] = NULL; // The list of arguments ends with NULL
+    args[count] = NULL; // The list of arguments ends with NULL
     return args;
 }
 
-char* find_executable(char* token)
+char* search_path(char* token)
 {
-    char full_path[MAX_PATH_LENGTH]; // Store the full path of concatting
+    char full_path[PATH_MAX]; // Store the full path of concatting
     // char* path_copy = strdup(path_variable);
     char* path_copy = strdup(getenv("PATH"));
     char* path_dir = strtok(path_copy, ":"); // Split PATH with :
@@ -243,533 +773,2543 @@ char* find_executable(char* token)
         path_dir = strtok(NULL, ":");
     }
     if (access(token, X_OK) == 0) {
+        free(result);
         result = strdup(token);
     }
-    if (result == NULL)
-    last_exit_status = -1;
     free(path_copy);
     return result;
 }
 
+unsigned hash_command_name(const char* name)
+{
+    unsigned hash = 5381;
+    while (*name)
+    hash = hash * 33 + (unsigned char)*name++;
+    return hash % COMMAND_HASH_SIZE;
+}
 
-void exec_fork(char** tokens)
+CommandHash* lookup_command(const char* name)
 {
+    CommandHash* curr = command_hash[hash_command_name(name)];
+    while (curr != NULL && strcmp(curr->name, name) != 0)
+    curr = curr->next;
+    return curr;
+}
 
-    char* full_path;
-    full_path = find_executable(tokens[0]);
-    if (full_path == NULL)
+// Add or refresh the remembered path of a command
+CommandHash* remember_command(char* name, char* path)
+{
+    CommandHash* entry = lookup_command(name);
+    if (entry == NULL)
     {
-        free(full_path);
-        last_exit_status = -1;
-        for (int j = 1; tokens[j] != NULL; j++)
+        entry = malloc(sizeof(CommandHash));
+        if (!entry)
         {
-            free(tokens[j]);
+            last_exit_status = -1;
+            exit(-1);
         }
-        free(tokens);
+        unsigned bucket = hash_command_name(name);
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        entry->next = command_hash[bucket];
+        command_hash[bucket] = entry;
     }
-    else
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->hits = 0;
+    return entry;
+}
+
+void forget_command(const char* name)
+{
+    CommandHash** link = &command_hash[hash_command_name(name)];
+    while (*link != NULL && strcmp((*link)->name, name) != 0)
+    link = &(*link)->next;
+    if (*link == NULL)
+    return;
+    CommandHash* entry = *link;
+    *link = entry->next;
+    free(entry);
+}
+
+void clear_command_hash(void)
+{
+    for (unsigned i = 0; i < COMMAND_HASH_SIZE; i++)
     {
-        pid_t pid = fork();
-        if (pid < 0)
+        CommandHash* curr = command_hash[i];
+        while (curr != NULL)
         {
-            // perror("Fork subprocess failed");
-            last_exit_status = -1;
-            for (int j = 1; tokens[j] != NULL; j++)
-            {
-                free(tokens[j]);
-            }
-            free(tokens);
-            exit(-1);
+            CommandHash* temp = curr;
+            curr = curr->next;
+            free(temp);
         }
-        else if (pid == 0)
+        command_hash[i] = NULL;
+    }
+}
+
+// Only names without a slash that were found on PATH are hashed, so a
+// repeated command costs no PATH walk and no access() calls
+int hashable_command(char* name, char* path)
+{
+    return strchr(name, '/') == NULL && strlen(name) < MAX_PATH_LENGTH &&
+        path != NULL && strlen(path) < MAX_PATH_LENGTH && strcmp(name, path) != 0;
+}
+
+// Full path of a command, or NULL; *hashed tells if it was remembered
+char* find_executable(char* token, int* hashed)
+{
+    CommandHash* entry = strchr(token, '/') == NULL ? lookup_command(token) : NULL;
+    *hashed = entry != NULL;
+    if (entry != NULL)
+    {
+        entry->hits++;
+        return strdup(entry->path);
+    }
+    char* result = search_path(token);
+    if (result == NULL)
+    last_exit_status = -1;
+    else if (hashable_command(token, result))
+    remember_command(token, result)->hits++;
+    return result;
+}
+
+
+// Launch with posix_spawn: the child gets its pipe ends and redirection
+// as file actions, so the shell neither copies its address space with
+// fork() nor rewires and restores its own descriptors. Returns the pid,
+// or -1 if the command could not be started.
+pid_t spawn_command(char* full_path, char** tokens, int in_fd, int out_fd,
+                    const Redirection* redirection)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd >= 0)
+    posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+    if (out_fd >= 0)
+    posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+    for (int i = 0; i < 2; i++)
+    if (redirection->fd >= 0 && redirection->targets[i] >= 0)
+    posix_spawn_file_actions_adddup2(&actions, redirection->fd, redirection->targets[i]);
+    pid_t pid;
+    int error = posix_spawn(&pid, full_path, &actions, NULL, tokens, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return error == 0 ? pid : -1;
+}
+
+// Find tokens[0] and spawn it. A remembered path that no longer starts
+// is forgotten and PATH searched again, as bash does.
+pid_t spawn_executable(char** tokens, int in_fd, int out_fd, const Redirection* redirection)
+{
+    int hashed;
+    char* full_path = find_executable(tokens[0], &hashed);
+    if (full_path == NULL)
+    return -1;
+    pid_t pid = spawn_command(full_path, tokens, in_fd, out_fd, redirection);
+    if (pid < 0 && hashed)
+    {
+        forget_command(tokens[0]);
+        free(full_path);
+        full_path = find_executable(tokens[0], &hashed);
+        if (full_path == NULL)
+        return -1;
+        pid = spawn_command(full_path, tokens, in_fd, out_fd, redirection);
+    }
+    free(full_path);
+    return pid;
+}
+
+// Wait for one child, collecting its resource usage if usage is not
+// NULL; 0 if it exited successfully, -1 otherwise. status gets the raw
+// wait status if it is not NULL.
+int wait_for_child(pid_t pid, int* raw_status, struct rusage* usage)
+{
+    int status;
+    while (wait4(pid, &status, 0, usage) == -1) {
+        if (errno == EINTR) {
+            // Keep waiting if it was interrupted by signal
+            continue;
+        } else {
+            // Deal with other error of waitpid
+            // perror("waitpid failed");
+            return -1;
+        }
+    }
+
+    if (raw_status != NULL)
+    *raw_status = status;
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        // perror("Command execution incorrectly");
+        return -1;
+    }
+    return 0;
+}
+
+long elapsed_us(const struct timespec* start, const struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+long timeval_us(const struct timeval* time)
+{
+    return time->tv_sec * 1000000L + time->tv_usec;
+}
+
+// WSH_PROFILE: one record per command run by exec_fork(), as a CSV row,
+// or a JSON object per line if the path ends in .json
+void open_profile(const char* path)
+{
+    size_t length = strlen(path);
+    profile_json = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+    profile_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    struct stat statbuf;
+    if (profile_fd < 0 || profile_json || fstat(profile_fd, &statbuf) != 0 || statbuf.st_size > 0)
+    return;
+    const char* header = "time_us,pid,exit,wall_us,spawn_us,user_us,sys_us,max_rss_kb,"
+        "voluntary_switches,involuntary_switches,command\n";
+    write_all(profile_fd, header, strlen(header));
+}
+
+// Copy the command into out, quoted for CSV or JSON; out needs room for
+// 6 bytes per byte of it and 3 more
+size_t quote_profile_command(char* out, char** tokens)
+{
+    size_t used = 0;
+    out[used++] = '"';
+    for (int i = 0; tokens[i] != NULL; i++)
+    {
+        if (i > 0)
+        out[used++] = ' ';
+        for (const unsigned char* c = (const unsigned char*)tokens[i]; *c; c++)
+        {
+            if (!profile_json)
+            {
+                if (*c == '"')
+                out[used++] = '"'; // "" inside a quoted field
+                out[used++] = *c;
+            }
+            else if (*c == '"' || *c == '\\')
+            {
+                out[used++] = '\\';
+                out[used++] = *c;
+            }
+            else if (*c < 0x20)
+            used += sprintf(out + used, "\\u%04x", *c);
+            else
+            out[used++] = *c;
+        }
+    }
+    out[used++] = '"';
+    out[used] = '\0';
+    return used;
+}
+
+// One write, so concurrent shells append whole records
+void record_profile(char** tokens, pid_t pid, int status, const struct timespec* start,
+                    const struct timespec* spawned, const struct timespec* end, const struct rusage* usage)
+{
+    size_t command_length = 0;
+    for (int i = 0; tokens[i] != NULL; i++)
+    command_length += strlen(tokens[i]) + 1;
+    char* command = arena_alloc(6 * command_length + 3);
+    quote_profile_command(command, tokens);
+    char* record = arena_alloc(6 * command_length + 512);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long time_us = now.tv_sec * 1000000L + now.tv_nsec / 1000 - elapsed_us(start, end);
+    int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    const char* format = profile_json ?
+        "{\"time_us\":%ld,\"pid\":%d,\"exit\":%d,\"wall_us\":%ld,\"spawn_us\":%ld,"
+        "\"user_us\":%ld,\"sys_us\":%ld,\"max_rss_kb\":%ld,\"voluntary_switches\":%ld,"
+        "\"involuntary_switches\":%ld,\"command\":%s}\n" :
+        "%ld,%d,%d,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%s\n";
+    int length = sprintf(record, format, time_us, (int)pid, exit_code, elapsed_us(start, end),
+                         elapsed_us(start, spawned), timeval_us(&usage->ru_utime), timeval_us(&usage->ru_stime),
+                         usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw, command);
+    write_all(profile_fd, record, length);
+}
+
+// time COMMAND: wall clock, and user and system time of the shell and the
+// children it waited for
+void start_timer(CommandTimer* timer)
+{
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+    getrusage(RUSAGE_SELF, &timer->self);
+    getrusage(RUSAGE_CHILDREN, &timer->children);
+}
+
+void report_timer(const CommandTimer* timer)
+{
+    struct timespec end;
+    struct rusage self, children;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    long times[3] = \
+    {
+        elapsed_us(&timer->start, &end),
+        timeval_us(&self.ru_utime) - timeval_us(&timer->self.ru_utime) +
+            timeval_us(&children.ru_utime) - timeval_us(&timer->children.ru_utime),
+        timeval_us(&self.ru_stime) - timeval_us(&timer->self.ru_stime) +
+            timeval_us(&children.ru_stime) - timeval_us(&timer->children.ru_stime)
+    };
+    // As bash prints it
+    fprintf(stderr, "\nreal\t%ldm%ld.%03lds\nuser\t%ldm%ld.%03lds\nsys\t%ldm%ld.%03lds\n",
+            times[0] / 60000000, times[0] / 1000000 % 60, times[0] / 1000 % 1000,
+            times[1] / 60000000, times[1] / 1000000 % 60, times[1] / 1000 % 1000,
+            times[2] / 60000000, times[2] / 1000000 % 60, times[2] / 1000 % 1000);
+}
+
+// The command after a leading "time", or NULL if there is none
+char* strip_time_prefix(char* line)
+{
+    line += strspn(line, " \t");
+    if (strncmp(line, "time", 4) != 0 || (line[4] != ' ' && line[4] != '\t'))
+    return NULL;
+    line += 4 + strspn(line + 4, " \t");
+    return *line != '\0' ? line : NULL;
+}
+
+void exec_fork(char** tokens)
+{
+
+    struct timespec start, spawned, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = spawn_executable(tokens, -1, -1, &redirection);
+    // posix_spawn returns once the child has exec'd
+    clock_gettime(CLOCK_MONOTONIC, &spawned);
+    if (pid < 0)
+    {
+        // perror("posix_spawn failed");
+        last_exit_status = -1;
+    }
+    else if (profile_fd >= 0)
+    {
+        int status = -1; // Unless the wait succeeds
+        struct rusage usage;
+        last_exit_status = wait_for_child(pid, &status, &usage);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (status != -1)
+        record_profile(tokens, pid, status, &start, &spawned, &end, &usage);
+    }
+    else
+    last_exit_status = wait_for_child(pid, NULL, NULL);
+}
+
+int built_in_index(const char* name)
+{
+    for (size_t i = 0; i < (sizeof(built_ins) / sizeof(struct built_in_command)); i++)
+    {
+        // Match name with keys in dictionary
+        if (strcmp(name, built_ins[i].key) == 0)
+        return i;
+    }
+    return -1;
+}
+
+built_in_func find_built_in(const char* name)
+{
+    int index = built_in_index(name);
+    return index < 0 ? NULL : built_ins[index].value;
+}
+
+// Run one stage of a pipeline without waiting for it. Builtins run in a
+// forked copy of the shell, so they can read and write pipes too.
+pid_t start_stage(char* stage, int in_fd, int out_fd, int spare_fd)
+{
+    Redirection stage_redirection;
+    int type, redirect_fd;
+    char* path;
+    char* command = scan_redirection(stage, &type, &redirect_fd, &path);
+    if (determine_annotation(command)) // Empty stage, e.g. "ls |"
+    return -1;
+    // Expanded first, so a $( ) reading the file sees it before > truncates it
+    char** tokens = split_input_to_token(command);
+    open_redirection(type, redirect_fd, path, &stage_redirection);
+    pid_t pid = -1;
+    built_in_func built_in = find_built_in(tokens[0]);
+    if (built_in != NULL)
+    {
+        pid = fork();
+        if (pid == 0)
+        {
+            if (in_fd >= 0)
+            dup2(in_fd, 0);
+            if (out_fd >= 0)
+            dup2(out_fd, 1);
+            redirect_descriptors(&stage_redirection);
+            if (spare_fd >= 0)
+            close(spare_fd);
+            forget_jobs();
+            last_exit_status = 0;
+            run_built_in(built_in, tokens, 1);
+            exit(last_exit_status);
+        }
+    }
+    else
+    {
+        pid = spawn_executable(tokens, in_fd, out_fd, &stage_redirection);
+    }
+    if (stage_redirection.fd >= 0)
+    close(stage_redirection.fd);
+    return pid;
+}
+
+// Start every stage of line into pids, the last writing to out_fd if it
+// is not -1; returns how many, -1 if too many. Each stage's text and
+// start times go to traces if it is not NULL.
+int launch_pipeline(char* line, pid_t* pids, int out_fd, StageTrace* traces)
+{
+    char* stages[MAXIMUM_PIPELINE];
+    int count = 0;
+    char* rest = line;
+    while (rest != NULL)
+    {
+        if (count == MAXIMUM_PIPELINE)
+        return -1;
+        char* bar = find_outside_substitution(rest, "|");
+        if (bar != NULL)
+        *bar = '\0';
+        stages[count++] = rest;
+        rest = bar != NULL ? bar + 1 : NULL;
+    }
+    int in_fd = -1;
+    for (int i = 0; i < count; i++)
+    {
+        int fds[2] = {-1, -1};
+        if (i + 1 < count)
+        {
+            if (pipe2(fds, O_CLOEXEC) != 0)
+            {
+                // perror("pipe failed");
+                count = i;
+                break;
+            }
+            fcntl(fds[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE); // Best effort
+        }
+        if (traces != NULL)
+        {
+            char* text = stages[i] + strspn(stages[i], " \t");
+            int length = strlen(text);
+            while (length > 0 && (text[length - 1] == ' ' || text[length - 1] == '\t'))
+            length--;
+            snprintf(traces[i].command, sizeof(traces[i].command), "%.*s", length, text);
+            clock_gettime(CLOCK_MONOTONIC, &traces[i].start);
+        }
+        pids[i] = start_stage(stages[i], in_fd, i + 1 < count ? fds[1] : out_fd, fds[0]);
+        if (traces != NULL)
+        clock_gettime(CLOCK_MONOTONIC, &traces[i].spawned);
+        if (in_fd >= 0)
+        close(in_fd);
+        if (fds[1] >= 0)
+        close(fds[1]);
+        in_fd = fds[0];
+    }
+    if (in_fd >= 0)
+    close(in_fd);
+    return count;
+}
+
+// One WSH_PROFILE record for a stage that has just been reaped
+void record_stage_profile(const StageTrace* trace, pid_t pid, int status, const struct rusage* usage)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    char* tokens[] = {(char*)trace->command, NULL};
+    record_profile(tokens, pid, status, &trace->start, &trace->spawned, &end, usage);
+}
+
+// cmd1 | cmd2 | ... : every stage starts before any is waited for, each
+// reading the previous stage's pipe. The status is the last stage's.
+// Stages are reaped in order, so a profiled stage's wall time runs until
+// the stages before it have finished too.
+void run_pipeline(char* line)
+{
+    pid_t pids[MAXIMUM_PIPELINE];
+    StageTrace traces[MAXIMUM_PIPELINE];
+    int count = launch_pipeline(line, pids, -1, profile_fd >= 0 ? traces : NULL);
+    last_exit_status = -1;
+    for (int i = 0; i < count; i++)
+    {
+        int raw_status;
+        struct rusage usage;
+        int status = pids[i] < 0 ? -1 : wait_for_child(pids[i], &raw_status, &usage);
+        if (pids[i] > 0 && profile_fd >= 0)
+        record_stage_profile(&traces[i], pids[i], raw_status, &usage);
+        if (i == count - 1)
+        last_exit_status = status;
+    }
+}
+
+// Background jobs. Every stage has a pidfd and, with wsh -j N, every job
+// its stdout on a pipe; all of them sit in one epoll set, so a wait only
+// touches what is ready and no signal handler races the job table.
+// Job output is written in start order: the oldest job with output left
+// writes through, later ones are held until it is done.
+int job_descriptor(Job* job, int stage, int fd)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)(job - jobs) * (MAXIMUM_PIPELINE + 1) + stage;
+    if (job_epoll < 0)
+    job_epoll = epoll_create1(EPOLL_CLOEXEC);
+    return job_epoll >= 0 ? epoll_ctl(job_epoll, EPOLL_CTL_ADD, fd, &event) : -1;
+}
+
+int job_finished(Job* job)
+{
+    return job->remaining == 0 && job->output < 0 && job->held_length == 0;
+}
+
+void record_stage_exit(Job* job, int stage, int status)
+{
+    job->pids[stage] = 0;
+    if (job->pidfds[stage] >= 0)
+    close(job->pidfds[stage]); // Also leaves the epoll set
+    else
+    polled_stages--;
+    job->pidfds[stage] = -1;
+    if (--job->remaining == 0)
+    running_job_count--;
+    if (stage == job->count - 1)
+    job->status = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+void reap_stage(Job* job, int stage)
+{
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(job->pids[stage], &status, WNOHANG, &usage)) == -1 && errno == EINTR)
+    continue;
+    if (pid == job->pids[stage] && job->traces != NULL && profile_fd >= 0)
+    record_stage_profile(&job->traces[stage], pid, status, &usage);
+    if (pid == job->pids[stage])
+    record_stage_exit(job, stage, status);
+    else if (pid == -1) // Not our child any more: nothing left to wait for
+    record_stage_exit(job, stage, 0);
+}
+
+void write_job_output(const char* data, size_t length)
+{
+    fflush(stdout);
+    write_all(1, data, length);
+}
+
+// The oldest job whose output is not all written yet, or NULL
+Job* next_output_job(void)
+{
+    Job* oldest = NULL;
+    for (int i = 0; i < job_slots; i++)
+    if (jobs[i].id != 0 && (jobs[i].output >= 0 || jobs[i].held_length > 0) &&
+        (oldest == NULL || jobs[i].sequence < oldest->sequence))
+    oldest = &jobs[i];
+    return oldest;
+}
+
+// Let the next job write through, after what it has been holding
+void advance_output(void)
+{
+    while ((output_job = next_output_job()) != NULL)
+    {
+        write_job_output(output_job->held, output_job->held_length);
+        free(output_job->held);
+        output_job->held = NULL;
+        output_job->held_length = 0;
+        output_job->held_capacity = 0;
+        if (output_job->output >= 0)
+        return;
+    }
+}
+
+void read_job_output(Job* job)
+{
+    char chunk[READ_CHUNK];
+    while (1)
+    {
+        ssize_t bytes = read(job->output, chunk, sizeof(chunk));
+        if (bytes < 0 && errno == EINTR)
+        continue;
+        if (bytes < 0 && errno == EAGAIN)
+        return;
+        if (bytes <= 0)
+        break;
+        if (job == output_job)
+        {
+            write_job_output(chunk, bytes);
+            continue;
+        }
+        if (job->held_length + bytes > job->held_capacity)
+        {
+            size_t capacity = job->held_capacity ? job->held_capacity : READ_CHUNK;
+            while (capacity < job->held_length + bytes)
+            capacity *= 2;
+            char* held = realloc(job->held, capacity);
+            if (held == NULL)
+            {
+                // perror("Realloc space for job output failed");
+                last_exit_status = -1;
+                exit(-1);
+            }
+            job->held = held;
+            job->held_capacity = capacity;
+        }
+        memcpy(job->held + job->held_length, chunk, bytes);
+        job->held_length += bytes;
+    }
+    close(job->output); // Also leaves the epoll set
+    job->output = -1;
+    if (job == output_job)
+    advance_output();
+}
+
+// Handle what is ready within timeout ms (-1: block until something is);
+// returns how many events were handled
+int process_job_events(int timeout)
+{
+    struct epoll_event events[JOB_EVENTS];
+    int ready = 0;
+    if (polled_stages > 0 && (timeout < 0 || timeout > JOB_POLL_MS))
+    timeout = JOB_POLL_MS; // Stages without a pidfd are polled
+    if (job_epoll >= 0)
+    ready = epoll_wait(job_epoll, events, JOB_EVENTS, timeout);
+    for (int i = 0; i < ready; i++)
+    {
+        Job* job = &jobs[events[i].data.u64 / (MAXIMUM_PIPELINE + 1)];
+        int stage = events[i].data.u64 % (MAXIMUM_PIPELINE + 1);
+        if (stage == MAXIMUM_PIPELINE)
+        read_job_output(job);
+        else if (job->pids[stage] > 0)
+        reap_stage(job, stage);
+    }
+    if (ready < 0)
+    ready = 0;
+    for (int i = 0; polled_stages > 0 && i < job_slots; i++)
+    for (int j = 0; jobs[i].id != 0 && j < jobs[i].count; j++)
+    if (jobs[i].pids[j] > 0 && jobs[i].pidfds[j] < 0)
+    {
+        reap_stage(&jobs[i], j);
+        ready += jobs[i].pids[j] == 0;
+    }
+    return ready;
+}
+
+int running_jobs(void)
+{
+    return running_job_count;
+}
+
+// Block until one stage of any job exits or output arrives
+void wait_for_any_job(void)
+{
+    process_job_events(-1);
+}
+
+// Wait for every stage and all the output of a job, and forget it
+int wait_job(Job* job)
+{
+    while (!job_finished(job))
+    process_job_events(-1);
+    job->id = 0;
+    return job->status;
+}
+
+// Wait for all jobs; returns the status of the one started last, or
+// status if there were none
+int wait_all_jobs(int status)
+{
+    unsigned long latest = 0;
+    for (int i = 0; i < job_slots; i++)
+    {
+        if (jobs[i].id == 0)
+        continue;
+        unsigned long sequence = jobs[i].sequence;
+        int job_status = wait_job(&jobs[i]);
+        if (sequence >= latest)
+        {
+            latest = sequence;
+            status = job_status;
+        }
+    }
+    return status;
+}
+
+// One slot per job that may run or hold output at once; every stage of
+// a running job holds a pidfd, so the descriptor limit is raised to match
+void allocate_jobs(int limit)
+{
+    job_slots = limit > JOB_SLOTS ? limit : JOB_SLOTS;
+    jobs = calloc(job_slots, sizeof(Job));
+    if (jobs == NULL)
+    {
+        // perror("Calloc space for jobs failed");
+        last_exit_status = -1;
+        exit(-1);
+    }
+    struct rlimit files;
+    if (limit > 0 && getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+}
+
+// In a forked copy of the shell: the jobs belong to the parent
+void forget_jobs(void)
+{
+    for (int i = 0; i < job_slots; i++)
+    {
+        for (int j = 0; jobs[i].id != 0 && j < jobs[i].count; j++)
+        if (jobs[i].pidfds[j] >= 0)
+        close(jobs[i].pidfds[j]);
+        if (jobs[i].id != 0 && jobs[i].output >= 0)
+        close(jobs[i].output);
+        free(jobs[i].held);
+        free(jobs[i].traces);
+    }
+    if (jobs != NULL)
+    memset(jobs, 0, job_slots * sizeof(Job));
+    if (job_epoll >= 0)
+    close(job_epoll);
+    job_epoll = -1;
+    output_job = NULL;
+    running_job_count = 0;
+    polled_stages = 0;
+}
+
+// Run line (a command or pipeline, without its &) as a job
+void run_background(char* line)
+{
+    static unsigned long next_sequence = 1;
+    if (running_job_count > 0)
+    process_job_events(0); // Reap what has finished, to free slots
+    Job* job = NULL;
+    while (1)
+    {
+        for (int i = 0; i < job_slots && job == NULL; i++)
+        if (jobs[i].id == 0 || job_finished(&jobs[i])) // Finished jobs are forgotten
+        job = &jobs[i];
+        if (job != NULL)
+        break;
+        process_job_events(-1); // Every slot is running or holding output
+    }
+    int fds[2] = {-1, -1};
+    if (parallel_jobs > 0 && pipe2(fds, O_CLOEXEC) != 0)
+    {
+        // perror("pipe failed");
+        last_exit_status = -1;
+        return;
+    }
+    snprintf(job->command, sizeof(job->command), "%s", line);
+    if (profile_fd >= 0 && job->traces == NULL)
+    job->traces = malloc(MAXIMUM_PIPELINE * sizeof(StageTrace)); // Kept with the slot
+    int count = launch_pipeline(line, job->pids, fds[1], profile_fd >= 0 ? job->traces : NULL);
+    if (fds[1] >= 0)
+    close(fds[1]);
+    if (count <= 0)
+    {
+        if (fds[0] >= 0)
+        close(fds[0]);
+        job->id = 0;
+        last_exit_status = -1;
+        return;
+    }
+    job->id = job - jobs + 1;
+    job->count = count;
+    job->remaining = 0;
+    job->status = -1;
+    job->sequence = next_sequence++;
+    job->output = fds[0];
+    for (int j = 0; j < count; j++)
+    {
+        job->pidfds[j] = -1;
+        if (job->pids[j] <= 0)
+        continue;
+        job->remaining++;
+        job->pidfds[j] = syscall(SYS_pidfd_open, job->pids[j], 0);
+        if (job->pidfds[j] >= 0 && job_descriptor(job, j, job->pidfds[j]) != 0)
+        {
+            close(job->pidfds[j]);
+            job->pidfds[j] = -1;
+        }
+        if (job->pidfds[j] < 0) // No pidfd (before Linux 5.3): polled
+        polled_stages++;
+    }
+    if (job->remaining > 0)
+    running_job_count++;
+    if (job->output >= 0)
+    {
+        fcntl(job->output, F_SETFL, O_NONBLOCK);
+        if (job_descriptor(job, MAXIMUM_PIPELINE, job->output) != 0)
+        {
+            // Cannot be watched: read it all before going on
+            fcntl(job->output, F_SETFL, 0);
+            read_job_output(job);
+        }
+        else if (output_job == NULL)
+        output_job = job;
+    }
+    if (isatty(fileno(stdin)))
+    printf("[%d] %d\n", job->id, (int)job->pids[count - 1]);
+    last_exit_status = 0;
+}
+
+// Strip a trailing & from line; returns 1 if there was one
+int strip_background(char* line)
+{
+    size_t length = strlen(line);
+    while (length > 0 && isspace((unsigned char)line[length - 1]))
+    length--;
+    if (length == 0 || line[length - 1] != '&')
+    return 0;
+    length--;
+    while (length > 0 && isspace((unsigned char)line[length - 1]))
+    length--;
+    line[length] = '\0';
+    return 1;
+}
+
+int starts_with_built_in(char* line)
+{
+    char name[MAX_PATH_LENGTH];
+    line += strspn(line, " \t");
+    size_t length = strcspn(line, " \t|<>&");
+    if (length >= sizeof(name))
+    return 0;
+    memcpy(name, line, length);
+    name[length] = '\0';
+    return find_built_in(name) != NULL;
+}
+
+int built_in_jobs(char** args, Writer* out)
+{
+    (void)args;
+    if (running_job_count > 0)
+    process_job_events(0);
+    for (int i = 0; i < job_slots; i++)
+    {
+        if (jobs[i].id == 0)
+        continue;
+        writer_printf(out, "[%d] %s\t%s\n", jobs[i].id, jobs[i].remaining > 0 ? "Running" : "Done",
+               jobs[i].command);
+        if (job_finished(&jobs[i]))
+        jobs[i].id = 0; // Done is reported once
+    }
+    last_exit_status = 0;
+    return 0;
+}
+
+// wait [%JOB | PID]...: with no arguments wait for every job
+int built_in_wait(char** args, Writer* out)
+{
+    (void)out;
+    if (args[1] == NULL)
+    {
+        wait_all_jobs(0);
+        last_exit_status = 0;
+        return 0;
+    }
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        Job* job = NULL;
+        long wanted = strtol(args[i] + (args[i][0] == '%'), NULL, 10);
+        for (int j = 0; j < job_slots && job == NULL; j++)
+        {
+            if (jobs[j].id == 0)
+            continue;
+            if (args[i][0] == '%' && jobs[j].id == wanted)
+            job = &jobs[j];
+            for (int k = 0; args[i][0] != '%' && k < jobs[j].count; k++)
+            if (jobs[j].pids[k] == wanted && wanted > 0)
+            job = &jobs[j];
+        }
+        last_exit_status = job != NULL ? wait_job(job) : -1;
+    }
+    return 0;
+}
+
+int built_in_exit(char** args, Writer* out)
+{
+    (void)out;
+    int length = 0;
+    for (int i = 0; args[i] != NULL; i++)
+    length++;
+    if (length > 1)
+    {
+        // perror("No extra args should be passed to exit");
+        last_exit_status = -1;
+        return 0;
+    }
+    if (parallel_jobs > 0)
+    last_exit_status = wait_all_jobs(last_exit_status);
+    free_memory();
+    exit(last_exit_status);
+}
+
+int built_in_cd(char** args, Writer* out)
+{
+    (void)out;
+    int length = 0;
+    for (int i = 0; args[i] != NULL; i++)
+    length++;
+    if ((length == 1) || (length > 2))
+    {
+        // perror("Wrong args are passed to cd");
+        last_exit_status = -1;
+        return 0;
+    }
+    if (chdir(args[1]) != 0)
+    {
+        // perror("Built in command cd execute incorrectly");
+        last_exit_status = -1;
+        return 0;
+    }
+    last_exit_status = 0;
+    return 0;
+}
+
+int built_in_export(char** args, Writer* out)
+{
+    (void)out;
+    char *name = strtok(args[1], "=");
+    char *value = strtok(NULL, "=");
+
+    if (name != NULL && value != NULL)
+    {
+        // setenv(name, value, 1);  // Set environ variable
+        if (setenv(name, value, 1) == 0) {
+            // Remembered locations may be wrong for the new PATH
+            if (strcmp(name, "PATH") == 0)
+            clear_command_hash();
+            last_exit_status = 0;
+            return 0;
+        }
+        else {
+            // perror("setenv failed");
+            last_exit_status = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int built_in_local(char** args, Writer* out)
+{
+    (void)out;
+    if (args[1])
+    {
+        char* var = strtok(args[1], "=");
+        char* value = strtok(NULL, "=");
+        // if (value==NULL)
+        // value = "";
+        if (var)
+        {
+            set_shell_var(var, value);
+            last_exit_status = 0;
+        }
+    }
+    return 0;
+}
+
+unsigned hash_var_name(const char* name, size_t length)
+{
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slot of name in the table, or of the empty slot ending its probe
+unsigned find_var_slot(const char* name, size_t length)
+{
+    unsigned mask = shell_vars.slot_count - 1;
+    unsigned slot = hash_var_name(name, length) & mask;
+    for (; shell_vars.slots[slot] != 0; slot = (slot + 1) & mask)
+    {
+        ShellVariable* var = &shell_vars.entries[shell_vars.slots[slot] - 1];
+        if (var->name != NULL && strncmp(var->name, name, length) == 0 && var->name[length] == '\0')
+        break;
+    }
+    return slot;
+}
+
+ShellVariable* get_shell_var(const char* name, size_t length)
+{
+    if (shell_vars.slot_count == 0)
+    return NULL;
+    unsigned index = shell_vars.slots[find_var_slot(name, length)];
+    return index == 0 ? NULL : &shell_vars.entries[index - 1];
+}
+
+// Drop removed entries and rehash into a table at most half full
+void rebuild_shell_vars(unsigned slot_count)
+{
+    unsigned live = 0;
+    for (unsigned i = 0; i < shell_vars.count; i++)
+    if (shell_vars.entries[i].name != NULL)
+    shell_vars.entries[live++] = shell_vars.entries[i];
+    shell_vars.count = live;
+    shell_vars.removed = 0;
+    while (slot_count < 2 * (live + 1))
+    slot_count *= 2;
+    free(shell_vars.slots);
+    shell_vars.slots = calloc(slot_count, sizeof(unsigned));
+    if (!shell_vars.slots)
+    {
+        last_exit_status = -1;
+        exit(-1);
+    }
+    shell_vars.slot_count = slot_count;
+    for (unsigned i = 0; i < live; i++)
+    {
+        char* name = shell_vars.entries[i].name;
+        shell_vars.slots[find_var_slot(name, strlen(name))] = i + 1;
+    }
+}
+
+int set_shell_var(char* name, char* value)
+{
+    ShellVariable* var = get_shell_var(name, strlen(name));
+    if (var != NULL)
+    {
+        if (value == NULL || strcmp(value, "") == 0) // Empty string, remove the variable
+        {
+            // The slot keeps pointing at the emptied entry until the next rebuild
+            free(var->name);
+            free(var->value);
+            var->name = NULL;
+            var->value = NULL;
+            shell_vars.removed++;
+            return 0;
+        }
+        char* new_value = strdup(value); // Update the variable's value if it's not empty
+        if (!new_value)
+        {
+            last_exit_status = -1;
+            exit(-1);
+        }
+        free(var->value);
+        var->value = new_value;
+        return 0;
+    }
+
+    // If variable does not exist and the value is empty, don't add it
+    if (value == NULL || strcmp(value, "") == 0) {
+        return 0;
+    }
+
+    // Grow the entries, and the table once it would be more than half
+    // full counting removed entries still in it
+    if (shell_vars.count == shell_vars.capacity)
+    {
+        unsigned new_capacity = shell_vars.capacity ? shell_vars.capacity * 2 : 16;
+        ShellVariable* new_entries = realloc(shell_vars.entries, new_capacity * sizeof(ShellVariable));
+        if (!new_entries)
+        {
+            // perror("Failed to allocate memory for new shell variable");
+            last_exit_status = -1;
+            exit(-1);
+        }
+        shell_vars.entries = new_entries;
+        shell_vars.capacity = new_capacity;
+    }
+    if (2 * (shell_vars.count + 1) > shell_vars.slot_count)
+    rebuild_shell_vars(shell_vars.slot_count ? shell_vars.slot_count : 32);
+    else if (shell_vars.removed > shell_vars.count / 2)
+    rebuild_shell_vars(shell_vars.slot_count);
+
+    // Insert the new variable at the end, keeping the order for vars
+    ShellVariable* new_var = &shell_vars.entries[shell_vars.count];
+    new_var->name = strdup(name);
+    new_var->value = strdup(value);
+    if (!new_var->name || !new_var->value)
+    {
+        last_exit_status = -1;
+        exit(-1);
+    }
+    shell_vars.slots[find_var_slot(name, strlen(name))] = ++shell_vars.count;
+    return 0;
+}
+
+void free_shell_vars(void)
+{
+    for (unsigned i = 0; i < shell_vars.count; i++)
+    {
+        free(shell_vars.entries[i].name);
+        free(shell_vars.entries[i].value);
+    }
+    free(shell_vars.entries);
+    free(shell_vars.slots);
+    memset(&shell_vars, 0, sizeof(shell_vars));
+}
+
+int built_in_vars(char** args, Writer* out)
+{
+    unsigned length=0; // Adjust to input args
+    while (args[length] != NULL)
+    length++;
+    for (unsigned i = 0; i < shell_vars.count; i++)
+    {
+        if (shell_vars.entries[i].name != NULL)
+        writer_printf(out, "%s=%s\n", shell_vars.entries[i].name, shell_vars.entries[i].value);
+    }
+    last_exit_status = 0;
+    return 0;
+}
+
+// The n-th most recent command, n starting at 1
+char* history_entry(unsigned n)
+{
+    return history[(history_start + history_count - n) % MAXIMUM_HISTORY];
+}
+
+// Keep only the newest keep commands
+void drop_oldest_history(unsigned keep)
+{
+    while (history_count > keep)
+    {
+        free(history[history_start]);
+        history[history_start] = NULL;
+        history_start = (history_start + 1) % MAXIMUM_HISTORY;
+        history_count--;
+    }
+}
+
+void append_history(char* command)
+{
+    if (history_count == history_capacity)
+    drop_oldest_history(history_capacity - 1);
+    history[(history_start + history_count) % MAXIMUM_HISTORY] = strdup(command);
+    history_count++;
+}
+
+// Map the history file; it is only parsed when history is first used
+void open_history_file(const char* home)
+{
+    char path[MAXIMUM_CWD];
+    snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+    history_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    struct stat statbuf;
+    if (history_fd < 0 || fstat(history_fd, &statbuf) != 0 || statbuf.st_size == 0)
+    return;
+    void* map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, history_fd, 0);
+    if (map == MAP_FAILED)
+    return;
+    history_map = map;
+    history_map_length = statbuf.st_size;
+    for (char* c = history_map; (c = memchr(c, '\n', history_map + history_map_length - c)) != NULL; c++)
+    history_file_lines++;
+    // Appended commands must start on a line of their own
+    if (history_map[history_map_length - 1] != '\n')
+    {
+        if (write(history_fd, "\n", 1) < 0)
+        {
+            // perror("history write failed");
+        }
+        history_file_lines++;
+    }
+}
+
+// Rewrite the history file as the commands in the ring, so it stops
+// growing; the mapping must be gone, as the file is cut in place
+void compact_history_file(void)
+{
+    size_t length = 0;
+    for (unsigned n = history_count; n > 0; n--)
+    length += strlen(history_entry(n)) + 1;
+    char* text = malloc(length + 1);
+    if (text == NULL)
+    return;
+    size_t used = 0;
+    for (unsigned n = history_count; n > 0; n--)
+    used += sprintf(text + used, "%s\n", history_entry(n));
+    // One write after the cut, so commands other shells append land after it
+    if (ftruncate(history_fd, 0) != 0 || write(history_fd, text, used) < 0)
+    {
+        // perror("history write failed");
+    }
+    history_file_lines = history_count;
+    free(text);
+}
+
+// Take the last lines of the mapped file into the ring, newest last
+void load_history(void)
+{
+    if (history_map == NULL)
+    return;
+    char* end = history_map + history_map_length;
+    char* start = end;
+    unsigned lines = 0;
+    // Walk back over at most history_capacity non-empty lines
+    while (start > history_map && lines < history_capacity)
+    {
+        char* line_end = start;
+        if (line_end[-1] == '\n')
+        line_end--;
+        char* line_start = line_end;
+        while (line_start > history_map && line_start[-1] != '\n')
+        line_start--;
+        if (line_end > line_start)
+        lines++;
+        start = line_start;
+    }
+    while (start < end)
+    {
+        char* newline = memchr(start, '\n', end - start);
+        char* line_end = newline ? newline : end;
+        if (line_end > start)
+        {
+            char* command = strndup(start, line_end - start);
+            append_history(command);
+            free(command);
+        }
+        start = line_end + 1;
+    }
+    munmap(history_map, history_map_length);
+    history_map = NULL;
+}
+
+int built_in_history(char** args, Writer* out)
+{
+    load_history();
+    unsigned length=0;
+    while (args[length] != NULL)
+    length++;
+    if (length == 1)
+    {
+        if (history_count == 0)
+        return 0;
+        for (unsigned counter = 1; counter <= history_count; counter++)
+        {
+            writer_printf(out, "%u) %s\n", counter, history_entry(counter));
+        }
+        last_exit_status = 0;
+    }
+    else if (length == 2)
+    {
+        unsigned exec_num = strtoul(args[1], NULL, 10);
+        if (exec_num == 0 || exec_num > history_count)
+        return 0; // Do nothing, keep prompting
+
+        char* command_to_execute = strdup(history_entry(exec_num));
+        if (find_outside_substitution(command_to_execute, "|") != NULL)
+        run_pipeline(command_to_execute);
+        else
+        {
+            char** tokens;
+            tokens = split_input_to_token(command_to_execute);
+            exec_fork(tokens);
+        }
+        free(command_to_execute);
+    }
+    else if (length == 3)
+    {
+        unsigned new_history_capacity = strtoul(args[2], NULL, 10);
+        // If get wrong new size
+        if (new_history_capacity == 0 || new_history_capacity > MAXIMUM_HISTORY)
+        {
+            // perror("Invalid history size");
+            last_exit_status = -1;
+            return 0;
+        }
+        // If shrinking the history, free the oldest commands; the ring
+        // always has MAXIMUM_HISTORY slots, so nothing moves
+        drop_oldest_history(new_history_capacity);
+        history_capacity = new_history_capacity;
+    }
+    else
+    {
+        // perror("Wrong args are passed to history");
+        last_exit_status = -1;
+        return 0;
+    }
+    return 0;
+}
+
+// Hidden from ls, like . and ..
+int hidden_name(const char* name)
+{
+    return name[0] == '.' && (name[1] == '\0' || strcmp(name, "..") == 0 ||
+        strcmp(name, ".DS_Store") == 0 || strcmp(name, ".gitignore") == 0);
+}
+
+// Sort names by their bytes from depth on, in strcmp order: MSD radix
+// sort through scratch, insertion sort once a bucket is small
+void sort_names(char** names, size_t count, size_t depth, char** scratch)
+{
+    if (count < LS_INSERTION_SORT)
+    {
+        for (size_t i = 1; i < count; i++)
+        {
+            char* name = names[i];
+            size_t j = i;
+            while (j > 0 && strcmp(names[j - 1] + depth, name + depth) > 0)
+            {
+                names[j] = names[j - 1];
+                j--;
+            }
+            names[j] = name;
+        }
+        return;
+    }
+    size_t counts[256] = {0};
+    size_t starts[256];
+    for (size_t i = 0; i < count; i++)
+    counts[(unsigned char)names[i][depth]]++;
+    size_t start = 0;
+    for (int byte = 0; byte < 256; byte++)
+    {
+        starts[byte] = start;
+        start += counts[byte];
+    }
+    for (size_t i = 0; i < count; i++)
+    scratch[starts[(unsigned char)names[i][depth]]++] = names[i];
+    memcpy(names, scratch, count * sizeof(char*));
+    // Bucket 0 holds names that ended here, already equal
+    start = counts[0];
+    for (int byte = 1; byte < 256; byte++)
+    {
+        if (counts[byte] > 1)
+        sort_names(names + start, counts[byte], depth + 1, scratch);
+        start += counts[byte];
+    }
+}
+
+// Imitate ls: the names in the current directory, sorted, or in directory
+// order with -f. Entries come from getdents64 in large batches; sorted
+// names are kept in the command arena, -f writes each batch as it goes.
+int built_in_ls(char** args, Writer* out)
+{
+    int length = 0;
+    for (int i = 0; args[i] != NULL; i++)
+        length++;
+    int unsorted = length == 2 && strcmp(args[1], "-f") == 0;
+    if (length > 1 && !unsorted)
+    {
+        // perror("No extra args should be passed to ls");
+        last_exit_status = -1;
+        return 0;
+    }
+
+    int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        // perror("Open . failed");
+        last_exit_status = -1;
+        return 0;
+    }
+
+    char* buffer = arena_alloc(LS_GETDENTS_SIZE);
+    size_t capacity = 1024;
+    size_t count = 0;
+    char** names = unsorted ? NULL : arena_alloc(capacity * sizeof(char*));
+    ssize_t bytes;
+    while ((bytes = getdents64(fd, buffer, LS_GETDENTS_SIZE)) > 0)
+    {
+        for (ssize_t offset = 0; offset < bytes; )
+        {
+            struct dirent64* entry = (struct dirent64*)(buffer + offset);
+            offset += entry->d_reclen;
+            if (hidden_name(entry->d_name))
+            continue;
+            size_t name_length = strlen(entry->d_name);
+            if (unsorted)
+            {
+                writer_put(out, entry->d_name, name_length);
+                writer_put(out, "\n", 1);
+                continue;
+            }
+            if (count == capacity)
+            {
+                char** grown = arena_alloc(capacity * 2 * sizeof(char*));
+                memcpy(grown, names, count * sizeof(char*));
+                names = grown;
+                capacity *= 2;
+            }
+            names[count++] = arena_copy(entry->d_name, name_length);
+        }
+    }
+    close(fd);
+    if (bytes < 0)
+    {
+        // perror("getdents64 failed");
+        last_exit_status = -1;
+        return 0;
+    }
+
+    if (!unsorted)
+    {
+        sort_names(names, count, 0, arena_alloc(count * sizeof(char*) + 1));
+        for (size_t i = 0; i < count; i++)
+        {
+            writer_put(out, names[i], strlen(names[i]));
+            writer_put(out, "\n", 1);
+        }
+    }
+    last_exit_status = 0;
+    return 0;
+}
+
+
+
+
+int built_in_hash(char** args, Writer* out)
+{
+    if (args[1] == NULL)
+    {
+        // Same layout as bash: hit count, then the remembered path
+        int empty = 1;
+        for (unsigned i = 0; i < COMMAND_HASH_SIZE; i++)
+        {
+            for (CommandHash* curr = command_hash[i]; curr != NULL; curr = curr->next)
+            {
+                if (empty)
+                writer_printf(out, "hits\tcommand\n");
+                empty = 0;
+                writer_printf(out, "%4u\t%s\n", curr->hits, curr->path);
+            }
+        }
+        if (empty)
+        writer_printf(out, "hash: hash table empty\n");
+        last_exit_status = 0;
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0 && args[2] == NULL)
+    {
+        clear_command_hash();
+        last_exit_status = 0;
+        return 0;
+    }
+    // hash NAME...: look the names up now and remember them
+    last_exit_status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        char* path = search_path(args[i]);
+        if (path == NULL)
+        last_exit_status = -1;
+        else if (hashable_command(args[i], path))
+        remember_command(args[i], path);
+        free(path);
+    }
+    return 0;
+}
+
+int handle_built_in_command(char** tokens)
+{
+    // Dealing with built-in command
+    built_in_func built_in = find_built_in(tokens[0]);
+    if (built_in != NULL)
+    {
+        // Builtins run in the shell and write straight to the redirection
+        int built_ins_output = run_built_in(built_in, tokens, built_in_output_fd(&redirection));
+        close_redirection(); // The output is written, the file is done with
+        return built_ins_output;
+    }
+    return 1;
+}
+
+void add_history(char* command)
+{
+    load_history();
+    append_history(command);
+    if (history_fd >= 0)
+    {
+        // One write, so concurrent shells append whole lines
+        size_t length = strlen(command);
+        char* line = malloc(length + 1);
+        if (line != NULL)
+        {
+            memcpy(line, command, length);
+            line[length] = '\n';
+            if (write(history_fd, line, length + 1) < 0)
+            {
+                // perror("history write failed");
+            }
+            free(line);
+        }
+        if (++history_file_lines >= HISTORY_COMPACT_FACTOR * history_capacity)
+        compact_history_file();
+    }
+}
+
+
+// Run one line as typed: comments, &, -j jobs, pipelines, builtins and
+// commands
+void run_line(char* input)
+{
+    // input = replace_vars_in_token(input);
+    // char *new_input = replace_vars_in_token(input);
+    char* timed = strip_time_prefix(input);
+    if (timed != NULL)
+    {
+        CommandTimer timer;
+        start_timer(&timer);
+        run_line(timed);
+        report_timer(&timer);
+        return;
+    }
+    char *new_input = replace_vars_in_first_token(input);
+    if (determine_annotation(new_input)) // Judge if this is an annotation
+    return;
+    // With -j N every line but a builtin is an independent job;
+    // builtins change the shell, so they wait for all jobs first
+    int background = strip_background(new_input);
+    if (background || (parallel_jobs > 0 && !starts_with_built_in(new_input)))
+    {
+        add_history(new_input);
+        if (parallel_jobs > 0)
+        {
+            while (running_jobs() >= parallel_jobs)
+            wait_for_any_job();
+        }
+        run_background(new_input);
+        return;
+    }
+    if (parallel_jobs > 0)
+    last_exit_status = wait_all_jobs(last_exit_status);
+    if (find_outside_substitution(new_input, "|") != NULL) // A pipeline is never a plain builtin
+    {
+        add_history(new_input);
+        run_pipeline(new_input);
+        return;
+    }
+    close_redirection();
+    int type, redirect_fd;
+    char* path;
+    char* command = scan_redirection(new_input, &type, &redirect_fd, &path);
+    char* ori_input = arena_copy(command, strlen(command));
+    // Split once: expanding runs any $( ) in the arguments, before the
+    // redirection opens (and maybe truncates) its file
+    char** tokens = split_input_to_token(command);
+    open_redirection(type, redirect_fd, path, &redirection);
+    int handle_built_in_command_output = handle_built_in_command(tokens); // Judge if this is a built-in command
+    if (handle_built_in_command_output == 1) // If not, fork
+    {
+        add_history(ori_input);
+        exec_fork(tokens);
+
+        // if (strcmp(new_input, command) != 0)
+        // {
+        //     restore_redirection();
+        // }
+    }
+    
+    // printf("input: %s\n", input);
+    // printf("command: %s\n", command);
+    // if (strcmp(new_input, command) != 0)
+    // {
+    //     // printf("here");
+    //     restore_redirection();
+    // }
+}
+
+int loop_propmt(char* prompt_tag)
+{
+    LineReader reader = {fileno(stdin), NULL, 0, 0, 0, 0};
+    CompiledScript block; // Lines of an unfinished if, while or for
+    char* input;
+    memset(&block, 0, sizeof(block));
+    // Imitate the shell
+    while (1)
+    {
+        if (strcmp(prompt_tag, "prompt") == 0)
+        printf("wsh> "); // loop output
+        input = read_line(&reader); // Get input from stdin
+        if (input == NULL) // EOF or error
+        {
+            // exit(0);
+            if (block.block_count > 0)
+            script_syntax_error();
+            if (parallel_jobs > 0)
+            last_exit_status = wait_all_jobs(last_exit_status);
+            exit(last_exit_status);
+        }
+        arena_reset(); // Drop the previous command's tokens
+        if (block.block_count > 0 || (input[0] != '$' && is_control_line(input)))
+        {
+            // Control flow is compiled like a script and runs once it is
+            // complete, in the foreground even with -j N
+            jmp_buf recovery;
+            if (strcmp(prompt_tag, "prompt") == 0)
+            {
+                if (setjmp(recovery) != 0)
+                {
+                    syntax_recovery = NULL;
+                    free_script(&block);
+                    continue;
+                }
+                syntax_recovery = &recovery;
+            }
+            compile_line(&block, input);
+            syntax_recovery = NULL;
+            if (block.block_count > 0)
+            continue;
+            int jobs_limit = parallel_jobs;
+            if (parallel_jobs > 0)
+            last_exit_status = wait_all_jobs(last_exit_status);
+            parallel_jobs = 0;
+            run_compiled_script(&block);
+            parallel_jobs = jobs_limit;
+            free_script(&block);
+            continue;
+        }
+        run_line(input);
+    }
+    last_exit_status = -1;
+}
+
+
+
+
+// Batch scripts are parsed once into a CompiledScript and then run from
+// it. Strings live in one pool addressed by offsets, so a .wshc cache file
+// is the same arrays written one after another. if/while/for compile to
+// branches and jumps between commands, (( )) to postfix items.
+
+// Make room for count more items after used ones in an array
+void* reserve_items(void* items, uint32_t* capacity, size_t used, size_t count, size_t size)
+{
+    if (used + count <= *capacity)
+    return items;
+    size_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < used + count)
+    new_capacity *= 2;
+    items = new_capacity <= UINT32_MAX ? realloc(items, new_capacity * size) : NULL;
+    if (items == NULL)
+    {
+        // perror("Realloc space for script failed");
+        last_exit_status = -1;
+        exit(-1);
+    }
+    *capacity = new_capacity;
+    return items;
+}
+
+uint32_t add_script_string(CompiledScript* script, const char* text, size_t length)
+{
+    script->strings = reserve_items(script->strings, &script->capacities[3], script->string_length, length + 1, 1);
+    uint32_t offset = script->string_length;
+    memcpy(script->strings + offset, text, length);
+    script->strings[offset + length] = '\0';
+    script->string_length += length + 1;
+    return offset;
+}
+
+// Append an argument to the last command; a slot is expanded each time
+// the command runs
+void add_script_arg(CompiledScript* script, const char* text, int slot)
+{
+    CompiledCommand* command = &script->commands[script->command_count - 1];
+    uint32_t offset = add_script_string(script, text, strlen(text));
+    script->args = reserve_items(script->args, &script->capacities[1], script->arg_count, 1, sizeof(uint32_t));
+    script->args[script->arg_count++] = offset;
+    if (slot)
+    {
+        script->slots = reserve_items(script->slots, &script->capacities[2], script->slot_count, 1, sizeof(uint32_t));
+        script->slots[script->slot_count++] = command->argc;
+        command->slot_count++;
+    }
+    command->argc++;
+}
+
+// Returns the index of the new command
+uint32_t add_script_command(CompiledScript* script, uint32_t kind)
+{
+    script->commands = reserve_items(script->commands, &script->capacities[0], script->command_count, 1, sizeof(CompiledCommand));
+    CompiledCommand* command = &script->commands[script->command_count];
+    memset(command, 0, sizeof(*command));
+    command->kind = kind;
+    command->built_in = -1;
+    command->first_arg = script->arg_count;
+    command->first_slot = script->slot_count;
+    return script->command_count++;
+}
+
+// A batch script stops here; at the prompt, loop_propmt() drops the
+// unfinished block and reads on
+void script_syntax_error(void)
+{
+    last_exit_status = -1;
+    if (syntax_recovery != NULL)
+    {
+        fprintf(stderr, "wsh: syntax error\n");
+        longjmp(*syntax_recovery, 1);
+    }
+    // printf("Syntax error\n");
+    exit(-1);
+}
+
+// Lines that depend on the shell when they run (a leading $), and
+// pipelines, & and empty commands are kept as text for run_line()
+void compile_command(CompiledScript* script, char* line)
+{
+    size_t length = strlen(line);
+    uint32_t string_length = script->string_length;
+    uint32_t arg_count = script->arg_count;
+    uint32_t slot_count = script->slot_count;
+    uint32_t timed = 0;
+    char* rest = strip_time_prefix(line);
+    if (rest != NULL)
+    {
+        line = rest;
+        length = strlen(line);
+        timed = 1;
+    }
+    uint32_t index = add_script_command(script, COMMAND_SIMPLE);
+    script->commands[index].timed = timed;
+    char* copy = arena_copy(line, length);
+    if (line[0] != '$' && find_outside_substitution(line, "|") == NULL && !strip_background(copy))
+    {
+        int type, redirect_fd;
+        char* path;
+        char* text = scan_redirection(arena_copy(line, length), &type, &redirect_fd, &path);
+        script->commands[index].text = add_script_string(script, text, strlen(text));
+        script->commands[index].redirect_type = type;
+        script->commands[index].redirect_fd = redirect_fd;
+        if (type != 0)
+        script->commands[index].redirect_path = add_script_string(script, path, strlen(path));
+        char* position = arena_copy(text, strlen(text));
+        char* token;
+        int globbed = 0; // Globs change the argument count: run as a line
+        while ((token = next_token(&position)) != NULL)
+        {
+            globbed |= script->commands[index].argc > 0 && glob_token(token);
+            add_script_arg(script, token, script->commands[index].argc > 0 &&
+                           (token[0] == '$' || strstr(token, "$(") != NULL));
+        }
+        if (script->commands[index].argc > 0 && !globbed)
+        {
+            script->commands[index].built_in = built_in_index(script->strings + script->args[script->commands[index].first_arg]);
+            return;
+        }
+    }
+    // Drop what an empty command added
+    script->string_length = string_length;
+    script->arg_count = arg_count;
+    script->slot_count = slot_count;
+    script->command_count--;
+    index = add_script_command(script, COMMAND_LINE);
+    script->commands[index].timed = timed;
+    script->commands[index].text = add_script_string(script, line, length);
+}
+
+// Cut the tokens of (( text )) into the arena; $NAME becomes NAME and $?
+// becomes ?
+char** lex_arithmetic(char* text, size_t* count)
+{
+    char** tokens = arena_alloc(sizeof(char*) * (strlen(text) + 1));
+    *count = 0;
+    while (*text != '\0')
+    {
+        size_t size = 0;
+        if (isspace((unsigned char)*text))
+        {
+            text++;
+            continue;
+        }
+        int variable = *text == '$';
+        text += variable;
+        if (variable && *text == '?')
+        size = 1;
+        else if (!variable && isdigit((unsigned char)*text))
+        size = strspn(text, "0123456789");
+        else if (isalpha((unsigned char)*text) || *text == '_')
+        while (isalnum((unsigned char)text[size]) || text[size] == '_')
+        size++;
+        else if (variable)
+        script_syntax_error();
+        else if ((strchr("<>=!+-*/%", *text) != NULL && text[1] == '=') ||
+                 (strchr("&|+-", *text) != NULL && text[1] == text[0]))
+        size = 2;
+        else if (strchr("()+-*/%<>!=", *text) != NULL)
+        size = 1;
+        else
+        script_syntax_error();
+        tokens[(*count)++] = arena_copy(text, size);
+        text += size;
+    }
+    return tokens;
+}
+
+const char* arithmetic_peek(ArithmeticParser* parser, size_t ahead)
+{
+    return parser->next + ahead < parser->count ? parser->tokens[parser->next + ahead] : "";
+}
+
+int arithmetic_accept(ArithmeticParser* parser, const char* token)
+{
+    if (strcmp(arithmetic_peek(parser, 0), token) != 0)
+    return 0;
+    parser->next++;
+    return 1;
+}
+
+// ++NAME is compiled as 1 :+NAME, NAME++ as 1 :+NAME 1 -
+void compile_increment(ArithmeticParser* parser, const char* name, const char* operator, int postfix)
+{
+    char* item = arena_alloc(strlen(name) + 3);
+    sprintf(item, ":%c%s", operator[0], name);
+    add_script_arg(parser->script, "1", 0);
+    add_script_arg(parser->script, item, 0);
+    if (postfix)
+    {
+        add_script_arg(parser->script, "1", 0);
+        add_script_arg(parser->script, operator[0] == '+' ? "-" : "+", 0);
+    }
+}
+
+int is_arithmetic_name(const char* token)
+{
+    return isalpha((unsigned char)token[0]) || token[0] == '_';
+}
+
+// Operand: number, variable, ? or a parenthesised expression, after any
+// unary operators; -x is compiled as 0 x -
+void parse_arithmetic_unary(ArithmeticParser* parser)
+{
+    const char* token = arithmetic_peek(parser, 0);
+    if (strcmp(token, "++") == 0 || strcmp(token, "--") == 0)
+    {
+        const char* name = arithmetic_peek(parser, 1);
+        if (!is_arithmetic_name(name))
+        script_syntax_error();
+        parser->next += 2;
+        compile_increment(parser, name, token, 0);
+    }
+    else if (is_arithmetic_name(token) &&
+             (strcmp(arithmetic_peek(parser, 1), "++") == 0 || strcmp(arithmetic_peek(parser, 1), "--") == 0))
+    {
+        compile_increment(parser, token, arithmetic_peek(parser, 1), 1);
+        parser->next += 2;
+    }
+    else if (arithmetic_accept(parser, "-"))
+    {
+        add_script_arg(parser->script, "0", 0);
+        parse_arithmetic_unary(parser);
+        add_script_arg(parser->script, "-", 0);
+    }
+    else if (arithmetic_accept(parser, "+"))
+    parse_arithmetic_unary(parser);
+    else if (arithmetic_accept(parser, "!"))
+    {
+        parse_arithmetic_unary(parser);
+        add_script_arg(parser->script, "!", 0);
+    }
+    else if (arithmetic_accept(parser, "("))
+    {
+        parse_arithmetic_assignment(parser);
+        if (!arithmetic_accept(parser, ")"))
+        script_syntax_error();
+    }
+    else if (isalnum((unsigned char)token[0]) || token[0] == '_' || token[0] == '?')
+    {
+        add_script_arg(parser->script, token, 0);
+        parser->next++;
+    }
+    else
+    script_syntax_error();
+}
+
+// Left-associative binary operators, loosest first
+void parse_arithmetic_binary(ArithmeticParser* parser, int level)
+{
+    static const char* levels[][5] = \
+    {
+        {"||", NULL},
+        {"&&", NULL},
+        {"==", "!=", NULL},
+        {"<", "<=", ">", ">=", NULL},
+        {"+", "-", NULL},
+        {"*", "/", "%", NULL}
+    };
+    if (level == sizeof(levels) / sizeof(levels[0]))
+    {
+        parse_arithmetic_unary(parser);
+        return;
+    }
+    parse_arithmetic_binary(parser, level + 1);
+    int matched = 1;
+    while (matched)
+    {
+        matched = 0;
+        for (int i = 0; levels[level][i] != NULL && !matched; i++)
+        {
+            if (arithmetic_accept(parser, levels[level][i]))
+            {
+                // && and || jump over their right operand when the left
+                // one decides: &>TARGET and |>TARGET, patched once known
+                uint32_t jump = UINT32_MAX;
+                if (level < 2)
+                {
+                    char item[3 + ARITHMETIC_TARGET_WIDTH];
+                    snprintf(item, sizeof(item), "%c>%0*u", levels[level][i][0], ARITHMETIC_TARGET_WIDTH, 0);
+                    add_script_arg(parser->script, item, 0);
+                    jump = parser->script->args[parser->script->arg_count - 1];
+                }
+                parse_arithmetic_binary(parser, level + 1);
+                add_script_arg(parser->script, levels[level][i], 0);
+                if (jump != UINT32_MAX)
+                {
+                    char target[1 + ARITHMETIC_TARGET_WIDTH];
+                    snprintf(target, sizeof(target), "%0*u", ARITHMETIC_TARGET_WIDTH,
+                             parser->script->commands[parser->script->command_count - 1].argc);
+                    memcpy(parser->script->strings + jump + 2, target, ARITHMETIC_TARGET_WIDTH);
+                }
+                matched = 1;
+            }
+        }
+    }
+}
+
+// NAME = x, NAME += x, ... are compiled as x :=NAME, x :+NAME, ...
+void parse_arithmetic_assignment(ArithmeticParser* parser)
+{
+    const char* name = arithmetic_peek(parser, 0);
+    const char* operator = arithmetic_peek(parser, 1);
+    size_t length = strlen(operator);
+    if (is_arithmetic_name(name) &&
+        ((length == 1 && operator[0] == '=') ||
+         (length == 2 && strchr("+-*/%", operator[0]) != NULL && operator[1] == '=')))
+    {
+        parser->next += 2;
+        parse_arithmetic_assignment(parser);
+        char* item = arena_alloc(strlen(name) + 3);
+        sprintf(item, ":%c%s", length == 1 ? '=' : operator[0], name);
+        add_script_arg(parser->script, item, 0);
+    }
+    else
+    parse_arithmetic_binary(parser, 0);
+}
+
+void compile_arithmetic(CompiledScript* script, char* text)
+{
+    size_t length = strlen(text);
+    while (length > 0 && isspace((unsigned char)text[length - 1]))
+    length--;
+    if (length < 4 || strncmp(text, "((", 2) != 0 || strncmp(text + length - 2, "))", 2) != 0)
+    script_syntax_error();
+    char* inside = arena_copy(text + 2, length - 4);
+    ArithmeticParser parser = {NULL, 0, 0, script};
+    parser.tokens = lex_arithmetic(inside, &parser.count);
+    add_script_command(script, COMMAND_ARITHMETIC);
+    parse_arithmetic_assignment(&parser);
+    if (parser.next != parser.count)
+    script_syntax_error();
+}
+
+// The condition of if and while: (( )) or any command line
+void compile_condition(CompiledScript* script, char* text)
+{
+    text += strspn(text, " \t");
+    if (*text == '\0')
+    script_syntax_error();
+    if (strncmp(text, "((", 2) == 0)
+    compile_arithmetic(script, text);
+    else
+    compile_command(script, text);
+}
+
+// Drop a trailing "; then" or "; do" from the rest of a block header
+void strip_block_keyword(char* text, const char* keyword)
+{
+    size_t length = strlen(text);
+    size_t keyword_length = strlen(keyword);
+    while (length > 0 && isspace((unsigned char)text[length - 1]))
+    length--;
+    if (length < keyword_length || strncmp(text + length - keyword_length, keyword, keyword_length) != 0)
+    return;
+    size_t end = length - keyword_length;
+    while (end > 0 && isspace((unsigned char)text[end - 1]))
+    end--;
+    if (end > 0 && text[end - 1] == ';')
+    text[end - 1] = '\0';
+}
+
+CompiledBlock* push_block(CompiledScript* script, uint32_t kind, uint32_t head, uint32_t branch)
+{
+    script->blocks = reserve_items(script->blocks, &script->block_capacity, script->block_count, 1, sizeof(CompiledBlock));
+    CompiledBlock* block = &script->blocks[script->block_count++];
+    block->kind = kind;
+    block->head = head;
+    block->branch = branch;
+    block->breaks = 0;
+    return block;
+}
+
+// The innermost block, which must be one of the given kinds
+CompiledBlock* top_block(CompiledScript* script, uint32_t first_kind, uint32_t last_kind)
+{
+    if (script->block_count == 0)
+    script_syntax_error();
+    CompiledBlock* block = &script->blocks[script->block_count - 1];
+    if (block->kind < first_kind || block->kind > last_kind)
+    script_syntax_error();
+    return block;
+}
+
+// Whether a line is (( )) or starts with a control flow keyword
+int is_control_line(char* line)
+{
+    static const char* keywords[] = {"if", "then", "else", "fi", "while", "for", "do", "done", "break", "continue"};
+    line += strspn(line, " \t");
+    if (strncmp(line, "((", 2) == 0)
+    return 1;
+    size_t length = strcspn(line, " \t");
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+    if (strlen(keywords[i]) == length && strncmp(line, keywords[i], length) == 0)
+    return 1;
+    return 0;
+}
+
+void compile_line(CompiledScript* script, char* line)
+{
+    if (line[0] != '$' && determine_annotation(line))
+    return;
+    if (line[0] == '$' || !is_control_line(line))
+    {
+        compile_command(script, line);
+        return;
+    }
+    char* rest = arena_copy(line, strlen(line));
+    if (strncmp(rest + strspn(rest, " \t"), "((", 2) == 0)
+    {
+        compile_arithmetic(script, rest + strspn(rest, " \t"));
+        return;
+    }
+    char* keyword = next_token(&rest);
+    if (strcmp(keyword, "then") == 0 || strcmp(keyword, "do") == 0)
+    return; // Optional, as in "if x" "then"
+    if (strcmp(keyword, "if") == 0)
+    {
+        strip_block_keyword(rest, "then");
+        compile_condition(script, rest);
+        push_block(script, BLOCK_IF, 0, add_script_command(script, COMMAND_BRANCH));
+    }
+    else if (strcmp(keyword, "else") == 0)
+    {
+        CompiledBlock* block = top_block(script, BLOCK_IF, BLOCK_IF);
+        uint32_t jump = add_script_command(script, COMMAND_JUMP);
+        script->commands[block->branch].target = script->command_count;
+        block->kind = BLOCK_ELSE;
+        block->branch = jump;
+    }
+    else if (strcmp(keyword, "fi") == 0)
+    {
+        CompiledBlock* block = top_block(script, BLOCK_IF, BLOCK_ELSE);
+        script->commands[block->branch].target = script->command_count;
+        script->block_count--;
+    }
+    else if (strcmp(keyword, "while") == 0)
+    {
+        uint32_t head = script->command_count;
+        strip_block_keyword(rest, "do");
+        compile_condition(script, rest);
+        push_block(script, BLOCK_WHILE, head, add_script_command(script, COMMAND_BRANCH));
+    }
+    else if (strcmp(keyword, "for") == 0)
+    {
+        // for NAME in WORD...: the variable and words are the loop's
+        strip_block_keyword(rest, "do");
+        char* name = next_token(&rest);
+        char* in = next_token(&rest);
+        if (name == NULL || in == NULL || strcmp(in, "in") != 0 ||
+            !(isalpha((unsigned char)name[0]) || name[0] == '_') || name[strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_")] != '\0')
+        script_syntax_error();
+        add_script_command(script, COMMAND_FOR_INIT);
+        uint32_t next = add_script_command(script, COMMAND_FOR_NEXT);
+        script->commands[next].text = add_script_string(script, name, strlen(name));
+        char* word;
+        while ((word = next_token(&rest)) != NULL)
+        add_script_arg(script, word, word[0] == '$' || strstr(word, "$(") != NULL);
+        push_block(script, BLOCK_FOR, next, next);
+    }
+    else if (strcmp(keyword, "done") == 0)
+    {
+        CompiledBlock* block = top_block(script, BLOCK_WHILE, BLOCK_FOR);
+        uint32_t jump = add_script_command(script, COMMAND_JUMP);
+        script->commands[jump].target = block->head;
+        script->commands[block->branch].target = script->command_count;
+        // Pending breaks are chained through their targets, index + 1
+        for (uint32_t pending = block->breaks; pending != 0; )
         {
-            char* full_path;
-            full_path = find_executable(tokens[0]);
-            if (strcmp(full_path, "") != 0)
-            {
-                size_t i = 0;
-                while (i < MAXIMUM_ARGS && tokens[i] != NULL)
-                i++;
-                tokens[i] = NULL;
-                execv(full_path, tokens);
-
-                for (int j = 1; tokens[j] != NULL; j++)
-                {
-                    free(tokens[j]);
-                }
-                free(tokens);
-                free(full_path);
-                // perror("execv failed");
-                last_exit_status = -1;
-                exit(-1);
-            }
-            else
-            free(full_path);
+            CompiledCommand* command = &script->commands[pending - 1];
+            pending = command->target;
+            command->target = script->command_count;
         }
+        script->block_count--;
+    }
+    else
+    {
+        // break or continue, in the innermost loop
+        uint32_t i = script->block_count;
+        while (i > 0 && script->blocks[i - 1].kind < BLOCK_WHILE)
+        i--;
+        if (i == 0 || next_token(&rest) != NULL)
+        script_syntax_error();
+        CompiledBlock* block = &script->blocks[i - 1];
+        uint32_t jump = add_script_command(script, COMMAND_JUMP);
+        if (strcmp(keyword, "continue") == 0)
+        script->commands[jump].target = block->head;
         else
         {
-            int status;
-            while (waitpid(pid, &status, 0) == -1) {
-                if (errno == EINTR) {
-                    // Keep waiting if it was interrupted by signal
-                    continue;
-                } else {
-                    // Deal with other error of waitpid
-                    // perror("waitpid failed");
-                    last_exit_status = -1;
-                    break;
-                }
-            }
-
-            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-                // perror("Command execution incorrectly");
-                last_exit_status = -1;
-            }
-            else
-                last_exit_status = 0;
-            for (int j = 1; tokens[j] != NULL; j++)
-            {
-                free(tokens[j]);
-            }
-            free(tokens);
-            free(full_path);
+            script->commands[jump].target = block->breaks;
+            block->breaks = jump + 1;
         }
     }
-    
 }
 
-int built_in_exit(char** args)
+void compile_script(CompiledScript* script, int fd)
 {
-    int length = 0;
-    for (int i = 0; args[i] != NULL; i++)
-    length++;
-    if (length > 1)
+    LineReader reader = {fd, NULL, 0, 0, 0, 0};
+    char* line;
+    memset(script, 0, sizeof(*script));
+    while ((line = read_line(&reader)) != NULL)
     {
-        // perror("No extra args should be passed to exit");
-        last_exit_status = -1;
-        return 0;
+        arena_reset();
+        compile_line(script, line);
     }
-    free_memory();
-    exit(last_exit_status);
+    free(reader.buffer);
+    if (script->block_count > 0) // An if or loop was not closed
+    script_syntax_error();
 }
 
-int built_in_cd(char** args)
+// The cache of path.wsh is path.wshc, of any other name path.wshc too
+char* script_cache_path(const char* path)
 {
-    int length = 0;
-    for (int i = 0; args[i] != NULL; i++)
-    length++;
-    if ((length == 1) || (length > 2))
-    {
-        // perror("Wrong args are passed to cd");
-        last_exit_status = -1;
-        return 0;
-    }
-    if (chdir(args[1]) != 0)
-    {
-        // perror("Built in command cd execute incorrectly");
-        last_exit_status = -1;
-        return 0;
-    }
-    last_exit_status = 0;
-    return 0;
+    size_t length = strlen(path);
+    int wsh = length >= 4 && strcmp(path + length - 4, ".wsh") == 0;
+    char* cache_path = malloc(length + 6);
+    if (cache_path == NULL)
+    return NULL;
+    sprintf(cache_path, wsh ? "%sc" : "%s.wshc", path);
+    return cache_path;
 }
 
-int built_in_export(char** args)
+// Check every count and offset of a cache read into memory, so a damaged
+// file is recompiled rather than trusted
+int check_script(const CompiledScript* script)
 {
-    char *name = strtok(args[1], "=");
-    char *value = strtok(NULL, "=");
-
-    if (name != NULL && value != NULL)
+    if (script->string_length > 0 && script->strings[script->string_length - 1] != '\0')
+    return 0;
+    for (uint32_t i = 0; i < script->arg_count; i++)
+    if (script->args[i] >= script->string_length)
+    return 0;
+    for (uint32_t i = 0; i < script->command_count; i++)
     {
-        // setenv(name, value, 1);  // Set environ variable
-        if (setenv(name, value, 1) == 0) {
-            last_exit_status = 0;
-            return 0;
-        }
-        else {
-            // perror("setenv failed");
-            last_exit_status = -1;
-            return -1;
-        }
+        const CompiledCommand* command = &script->commands[i];
+        int has_text = command->kind == COMMAND_SIMPLE || command->kind == COMMAND_LINE ||
+            command->kind == COMMAND_FOR_NEXT;
+        int has_target = command->kind == COMMAND_BRANCH || command->kind == COMMAND_JUMP ||
+            command->kind == COMMAND_FOR_NEXT;
+        if (command->kind > COMMAND_FOR_NEXT ||
+            (has_text && command->text >= script->string_length) ||
+            (has_target && command->target > script->command_count) ||
+            command->redirect_type < 0 || command->redirect_type > 5 ||
+            (command->redirect_type != 0 && command->redirect_path >= script->string_length) ||
+            (uint64_t)command->first_arg + command->argc > script->arg_count ||
+            (uint64_t)command->first_slot + command->slot_count > script->slot_count ||
+            command->built_in < -1 ||
+            command->built_in >= (int32_t)(sizeof(built_ins) / sizeof(struct built_in_command)) ||
+            (command->kind == COMMAND_SIMPLE && command->argc == 0))
+        return 0;
+        for (uint32_t j = 0; j < command->slot_count; j++)
+        if (script->slots[command->first_slot + j] >= command->argc)
+        return 0;
     }
-    return 0;
+    return 1;
 }
 
-int built_in_local(char** args)
+// Load the cache if it was written for this version of the script
+int load_script_cache(CompiledScript* script, const char* cache_path, const struct stat* source)
 {
-    if (args[1])
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    return 0;
+    struct stat statbuf;
+    ScriptCacheHeader header;
+    char* memory = NULL;
+    int loaded = 0;
+    if (fstat(fd, &statbuf) == 0 && read(fd, &header, sizeof(header)) == sizeof(header) &&
+        memcmp(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.mtime_sec == source->st_mtim.tv_sec && header.mtime_nsec == source->st_mtim.tv_nsec &&
+        header.size == source->st_size)
     {
-        char* var = strtok(args[1], "=");
-        char* value = strtok(NULL, "=");
-        // if (value==NULL)
-        // value = "";
-        if (var)
+        uint64_t length = (uint64_t)header.command_count * sizeof(CompiledCommand) +
+            ((uint64_t)header.arg_count + header.slot_count) * sizeof(uint32_t) + header.string_length;
+        if (length == (uint64_t)statbuf.st_size - sizeof(header) &&
+            (memory = malloc(length + 1)) != NULL &&
+            read(fd, memory, length) == (ssize_t)length)
         {
-            set_shell_var(var, value);
-            last_exit_status = 0;
+            script->commands = (CompiledCommand*)memory;
+            script->args = (uint32_t*)(script->commands + header.command_count);
+            script->slots = script->args + header.arg_count;
+            script->strings = (char*)(script->slots + header.slot_count);
+            script->command_count = header.command_count;
+            script->arg_count = header.arg_count;
+            script->slot_count = header.slot_count;
+            script->string_length = header.string_length;
+            script->memory = memory;
+            loaded = check_script(script);
         }
     }
-    return 0;
+    if (!loaded)
+    {
+        free(memory);
+        memset(script, 0, sizeof(*script));
+    }
+    close(fd);
+    return loaded;
 }
 
-int set_shell_var(char* name, char* value)
+int write_all(int fd, const void* data, size_t length)
 {
-    ShellVariable* prev = NULL;
-    ShellVariable* curr = shell_vars;
-
-    // Traverse the list of variables to check if the variable already exists
-    while (curr != NULL)
+    while (length > 0)
     {
-        if (strcmp(curr->name, name) == 0) // Variable found
-        {
-            if (value == NULL || strcmp(value, "") == 0) // Empty string, remove the variable
-            {
-                if (prev == NULL)
-                    shell_vars = curr->next; // Removing the first element in the list
-                else
-                    prev->next = curr->next;
-                free(curr);
-                return 0;
-            }
-            strcpy(curr->value, value); // Update the variable's value if it's not empty
-            return 0;
-        }
-        prev = curr;
-        curr = curr->next;
-    }
-
-    // If variable does not exist and the value is empty, don't add it
-    if (value == NULL || strcmp(value, "") == 0) {
+        ssize_t bytes = write(fd, data, length);
+        if (bytes < 0 && errno == EINTR)
+        continue;
+        if (bytes <= 0)
         return 0;
+        data = (const char*)data + bytes;
+        length -= bytes;
     }
+    return 1;
+}
 
-    // If variable is new, create it
-    ShellVariable* new_var = malloc(sizeof(ShellVariable));
-    if (!new_var)
+// Best effort: written beside the script and renamed into place, so a
+// concurrent run sees the old cache or the new one
+void write_script_cache(const CompiledScript* script, const char* cache_path, const struct stat* source)
+{
+    ScriptCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+    header.mtime_sec = source->st_mtim.tv_sec;
+    header.mtime_nsec = source->st_mtim.tv_nsec;
+    header.size = source->st_size;
+    header.command_count = script->command_count;
+    header.arg_count = script->arg_count;
+    header.slot_count = script->slot_count;
+    header.string_length = script->string_length;
+    char* temporary = malloc(strlen(cache_path) + 8);
+    if (temporary == NULL)
+    return;
+    sprintf(temporary, "%sXXXXXX", cache_path);
+    int fd = mkostemp(temporary, O_CLOEXEC);
+    if (fd < 0)
     {
-        // perror("Failed to allocate memory for new shell variable");
-        last_exit_status = -1;
-        exit(-1);
+        free(temporary);
+        return;
     }
-    strcpy(new_var->name, name);
-    strcpy(new_var->value, value);
-    new_var->next = NULL;
+    int written = write_all(fd, &header, sizeof(header)) &&
+        write_all(fd, script->commands, script->command_count * sizeof(CompiledCommand)) &&
+        write_all(fd, script->args, script->arg_count * sizeof(uint32_t)) &&
+        write_all(fd, script->slots, script->slot_count * sizeof(uint32_t)) &&
+        write_all(fd, script->strings, script->string_length);
+    if (close(fd) != 0 || !written || rename(temporary, cache_path) != 0)
+    unlink(temporary);
+    free(temporary);
+}
 
-    // Insert the new variable at the end of the list
-    if (shell_vars == NULL) {
-        shell_vars = new_var; // If list is empty, set the first variable
-    } else {
-        ShellVariable* tail = shell_vars;
-        while (tail->next != NULL) {
-            tail = tail->next;
-        }
-        tail->next = new_var; // Add the new variable at the end of the list
+void free_script(CompiledScript* script)
+{
+    if (script->memory != NULL)
+    free(script->memory);
+    else
+    {
+        free(script->commands);
+        free(script->args);
+        free(script->slots);
+        free(script->strings);
     }
-
-    return 0;
+    free(script->blocks);
+    memset(script, 0, sizeof(*script));
 }
 
-void free_shell_vars(void)
+// Value of a variable in (( )): the environment first, as for $NAME,
+// then shell variables; 0 if unset
+long arithmetic_value(const char* name)
 {
-    ShellVariable* curr = shell_vars;
-    while (curr != NULL)
+    const char* value = getenv(name);
+    if (value == NULL)
     {
-        ShellVariable* temp = curr;
-        curr = curr->next;
-        free(temp);
+        ShellVariable* var = get_shell_var(name, strlen(name));
+        value = var != NULL ? var->value : NULL;
     }
+    return value != NULL ? strtol(value, NULL, 10) : 0;
 }
 
-int built_in_vars(char** args)
+void assign_arithmetic(const char* name, long value)
 {
-    unsigned length=0; // Adjust to input args
-    while (args[length] != NULL)
-    length++;
-    ShellVariable* curr = shell_vars;
-    while (curr != NULL)
+    char text[32];
+    snprintf(text, sizeof(text), "%ld", value);
+    if (getenv(name) != NULL)
     {
-        printf("%s=%s\n", curr->name, curr->value);
-        curr = curr->next;
+        setenv(name, text, 1);
+        if (strcmp(name, "PATH") == 0)
+        clear_command_hash();
     }
-    last_exit_status = 0;
-    return 0;
+    else
+    set_shell_var((char*)name, text);
 }
 
-int built_in_history(char** args)
+// a operator b into result; 0 for division by zero. Overflow wraps.
+int apply_arithmetic(const char* operator, long a, long b, long* result)
 {
-    unsigned length=0;
-    while (args[length] != NULL)
-    length++;
-    if (length == 1)
+    switch (operator[0])
     {
-        if (history_count == 0)
-        return 0;
-        unsigned counter = 1;
-        int start_record = history_count - 1;
-        for (int i = start_record; i >= 0; i--)
-        {
-            printf("%u) %s\n", counter, history[i]);
-            counter++;
-        }
-        last_exit_status = 0;
+        case '+': *result = (long)((unsigned long)a + (unsigned long)b); break;
+        case '-': *result = (long)((unsigned long)a - (unsigned long)b); break;
+        case '*': *result = (long)((unsigned long)a * (unsigned long)b); break;
+        case '/':
+        case '%':
+            if (b == 0 || (a == LONG_MIN && b == -1))
+            return 0;
+            *result = operator[0] == '/' ? a / b : a % b;
+            break;
+        case '<': *result = operator[1] == '=' ? a <= b : a < b; break;
+        case '>': *result = operator[1] == '=' ? a >= b : a > b; break;
+        case '=': *result = a == b; break;
+        case '!': *result = a != b; break;
+        case '&': *result = a && b; break;
+        case '|': *result = a || b; break;
+        default: return 0;
     }
-    else if (length == 2)
-    {
-        unsigned exec_num = strtoul(args[1], NULL, 10);
-        if (exec_num == 0 || exec_num > history_count)
-        return 0; // Do nothing, keep prompting
+    return 1;
+}
 
-        unsigned counter = 1;
-        int start_record = history_count - 1;
-        for (int i = start_record; i >= 0; i--)
+// Run the postfix items of (( )): 0 if the result is not zero, -1 if it
+// is zero or the expression failed
+int evaluate_arithmetic(const CompiledScript* script, const CompiledCommand* command)
+{
+    long* stack = arena_alloc(sizeof(long) * (command->argc + 1));
+    uint32_t depth = 0;
+    for (uint32_t i = 0; i < command->argc; i++)
+    {
+        const char* item = script->strings + script->args[command->first_arg + i];
+        if (isdigit((unsigned char)item[0]))
+        stack[depth++] = strtol(item, NULL, 10);
+        else if (item[0] == '?')
+        stack[depth++] = last_exit_status & 0xff;
+        else if (isalpha((unsigned char)item[0]) || item[0] == '_')
+        stack[depth++] = arithmetic_value(item);
+        else if ((item[0] == '&' || item[0] == '|') && item[1] == '>')
         {
-            if (exec_num == counter)
+            // Short circuit: the left operand alone is the result, 0 or 1
+            if (depth < 1)
+            return -1;
+            if ((stack[depth - 1] != 0) == (item[0] == '|'))
             {
-                char* command_to_execute = strdup(history[i]);
-                char** tokens;
-                tokens = split_input_to_token(command_to_execute);
-                free(command_to_execute);
-                exec_fork(tokens);
+                unsigned long target = strtoul(item + 2, NULL, 10);
+                if (target <= i || target > command->argc)
+                return -1;
+                stack[depth - 1] = item[0] == '|';
+                i = target - 1;
             }
-            counter++;
         }
-    }
-    else if (length == 3)
-    {
-        unsigned new_history_capacity = strtoul(args[2], NULL, 10);
-        // If get wrong new size
-        if (new_history_capacity == 0 || new_history_capacity > MAXIMUM_HISTORY)
+        else if (item[0] == '!' && item[1] == '\0')
         {
-            // perror("Invalid history size");
-            last_exit_status = -1;
-            return 0;
+            if (depth < 1)
+            return -1;
+            stack[depth - 1] = !stack[depth - 1];
         }
-        // If shrinking the history, free the extra commands
-        if (new_history_capacity < history_count)
-        {
-            // for (unsigned i = 0; i < history_count - new_history_capacity; i++)
-            // free(history[i]);
-            // for (unsigned i = history_count - new_history_capacity; i < history_count; i++)
-            // history[i - (history_count - new_history_capacity)] = history[i];
-            // history[history_capacity] = NULL;
-            // history_count = new_history_capacity;
-            for (unsigned i = 0; i < history_count - new_history_capacity; i++) {
-                free(history[i]);
-            }
-            // Move the remaining commands to the front of the array
-            for (unsigned i = history_count - new_history_capacity; i < history_count; i++) {
-                history[i - (history_count - new_history_capacity)] = history[i];
-            }
-            history_count = new_history_capacity;
-            // Resize the history array to the new capacity
-            char** new_history = realloc(history, new_history_capacity * sizeof(char*));
-            if (new_history == NULL) {
-                return 0; // Handle realloc failure, the old memory is still valid, so no leak here
-            }
-            history = new_history;
+        else if (item[0] == ':')
+        {
+            // :=NAME or :<operator>NAME
+            if (depth < 1 || item[1] == '\0' || item[2] == '\0')
+            return -1;
+            long value = stack[depth - 1];
+            char operator[2] = {item[1], '\0'};
+            if (item[1] != '=' && !apply_arithmetic(operator, arithmetic_value(item + 2), value, &value))
+            return -1;
+            assign_arithmetic(item + 2, value);
+            stack[depth - 1] = value;
+        }
+        else
+        {
+            if (depth < 2 || !apply_arithmetic(item, stack[depth - 2], stack[depth - 1], &stack[depth - 2]))
+            return -1;
+            depth--;
         }
-        history_capacity = new_history_capacity;
-    }
-    else
-    {
-        // perror("Wrong args are passed to history");
-        last_exit_status = -1;
-        return 0;
     }
-    return 0;
-}
-
-int compare(const void *a, const void *b) {
-    return strcmp(*(const char **)a, *(const char **)b);
+    return depth == 1 && stack[0] != 0 ? 0 : -1;
 }
 
-int built_in_ls(char** args)
+// Run one simple command or line the way run_line() would run its line
+void run_compiled_command(const CompiledScript* script, const CompiledCommand* command)
 {
-    int length = 0;
-    for (int i = 0; args[i] != NULL; i++)
-        length++;
-    if (length > 1)
+    char* text = script->strings + command->text;
+    if (command->kind == COMMAND_LINE)
     {
-        // perror("No extra args should be passed to ls");
-        last_exit_status = -1;
-        return 0;
+        run_line(text);
+        return;
     }
-
-    // Imitate ls
-    char cwd[MAXIMUM_CWD];
-    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    char** args = arena_alloc(sizeof(char*) * (command->argc + 1));
+    const uint32_t* arg = script->args + command->first_arg;
+    for (uint32_t i = 0; i < command->argc; i++)
     {
-        // perror("ls execute incorrectly when getcwd()");
-        last_exit_status = -1;
-        return 0;
-    }
-
-    DIR *dir;
-    struct dirent* entry;
-    dir = opendir(cwd);
-    if (dir == NULL) {
-        // perror("Opendir failed");
-        last_exit_status = -1;
-        return 0;
+        args[i] = script->strings + arg[i];
+        // Builtins may cut their arguments up, so they get copies
+        if (command->built_in >= 0)
+        args[i] = arena_copy(args[i], strlen(args[i]));
     }
-
-    // Build an array to store those file names
-    char *filenames[1024];  // Assume that no more than 1024 files
-    int count = 0;
-
-    // Read and save file names to array
-    while ((entry = readdir(dir)) != NULL) 
+    args[command->argc] = NULL;
+    for (uint32_t i = 0; i < command->slot_count; i++)
     {
-        // jump . and .. and .DS_Store and .gitignore
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
-            strcmp(entry->d_name, ".DS_Store") == 0 || strcmp(entry->d_name, ".gitignore") == 0) 
-        {
-            continue;
-        }
-        filenames[count] = strdup(entry->d_name);
-        count++;
+        uint32_t slot = script->slots[command->first_slot + i];
+        args[slot] = replace_vars_in_token(args[slot]);
     }
-    closedir(dir);
-
-    // Sort file names
-    qsort(filenames, count, sizeof(char *), compare);
-
-    for (int i = 0; i < count; i++) {
-        printf("%s\n", filenames[i]);
-        free(filenames[i]);
+    close_redirection();
+    open_redirection(command->redirect_type, command->redirect_fd,
+                     script->strings + command->redirect_path, &redirection);
+    if (command->built_in >= 0)
+    {
+        run_built_in(built_ins[command->built_in].value, args, built_in_output_fd(&redirection));
+        close_redirection();
+        return;
     }
-    last_exit_status = 0;
-    return 0;
+    add_history(text);
+    exec_fork(args);
 }
 
-
-
-
-int handle_built_in_command(char* input)
+// Expand the words of a for's COMMAND_FOR_NEXT into loop once, as the
+// loop starts: variables, $( ) and globs, as for a command's arguments
+void expand_loop_words(const CompiledScript* script, const CompiledCommand* command, LoopWords* loop)
 {
-    // Dealing with built-in command
-    char** tokens = split_input_to_token(input);
-    for (size_t i = 0; i < (sizeof(built_ins) / sizeof(struct built_in_command)); i++)
+    size_t capacity = 8;
+    size_t count = 0;
+    char** words = arena_alloc(sizeof(char*) * capacity);
+    for (uint32_t j = 0; j < command->argc; j++)
+    {
+        char* word = script->strings + script->args[command->first_arg + j];
+        int slot = 0;
+        for (uint32_t k = 0; k < command->slot_count && !slot; k++)
+        slot = script->slots[command->first_slot + k] == j;
+        if (glob_token(word))
+        words = append_glob(words, &count, &capacity, slot ? replace_vars_in_token(word) : word);
+        else
+        words = append_arg(words, &count, &capacity, slot ? replace_vars_in_token(word) : word);
+    }
+    loop->length = 0;
+    loop->next = 0;
+    for (size_t j = 0; j < count; j++)
     {
-        // Match tokens[0] with keys in dictionary
-        if (strcmp(tokens[0], built_ins[i].key) == 0)
+        size_t length = strlen(words[j]) + 1;
+        if (loop->length + length > loop->capacity)
         {
-            int built_ins_output = (built_ins[i].value)(tokens);
-            for (int j = 1; tokens[j] != NULL; j++)
+            size_t capacity = loop->capacity > 0 ? loop->capacity : MAX_COMMAND_LEN;
+            while (loop->length + length > capacity)
+            capacity *= 2;
+            char* grown = realloc(loop->pool, capacity);
+            if (grown == NULL)
             {
-                free(tokens[j]);
+                // perror("Realloc space for loop words failed");
+                last_exit_status = -1;
+                exit(-1);
             }
-            free(tokens);
-            return built_ins_output;
+            loop->pool = grown;
+            loop->capacity = capacity;
         }
+        memcpy(loop->pool + loop->length, words[j], length);
+        loop->length += length;
     }
-    // Free space
-    for (int j = 1; tokens[j] != NULL; j++)
-    {
-        free(tokens[j]);
-    }
-    free(tokens);
-    return 1;
 }
 
-
-int loop_propmt(char* prompt_tag)
+// Run commands in order, following branches and jumps
+void run_compiled_script(const CompiledScript* script)
 {
-    char input[MAXIMUM_PATH]; // Limit the length of input
-    char* get_input;
-    history = (char**)malloc(MAXIMUM_HISTORY * sizeof(char*)); // Set maximum records of history
-    // Imitate the shell
-    while (1)
+    LoopWords* loops = calloc(script->command_count + 1, sizeof(LoopWords)); // Of each for
+    if (loops == NULL)
     {
-        if (strcmp(prompt_tag, "prompt") == 0)
-        printf("wsh> "); // loop output
-        get_input = fgets(input, sizeof(input), stdin); //Get input from stdin
-        if (get_input == NULL) // EOF or error
+        last_exit_status = -1;
+        exit(-1);
+    }
+    uint32_t i = 0;
+    while (i < script->command_count)
+    {
+        const CompiledCommand* command = &script->commands[i++];
+        arena_reset(); // Drop the previous command's tokens
+        if (command->kind == COMMAND_ARITHMETIC)
+        last_exit_status = evaluate_arithmetic(script, command);
+        else if (command->kind == COMMAND_BRANCH)
         {
-            // exit(0);
-            exit(last_exit_status);
+            if (last_exit_status != 0)
+            i = command->target;
         }
-        input[strcspn(input, "\n")] = 0;
-        // input = replace_vars_in_token(input);
-        // char *new_input = replace_vars_in_token(input);
-        char *new_input = replace_vars_in_first_token(input);
-        if (determine_annotation(new_input)) // Judge if this is an annotation
-        continue;
-        char *command = parse_and_execute(new_input);
-        char* ori_input = strdup(new_input);
-        int handle_built_in_command_output = handle_built_in_command(command); // Judge if this is a built-in command
-        if (handle_built_in_command_output == 1) // If not, fork
+        else if (command->kind == COMMAND_JUMP)
+        i = command->target;
+        else if (command->kind == COMMAND_FOR_INIT)
+        expand_loop_words(script, &script->commands[i], &loops[i]); // The COMMAND_FOR_NEXT that follows
+        else if (command->kind == COMMAND_FOR_NEXT)
         {
-            if (history_count < history_capacity)
+            LoopWords* loop = &loops[i - 1];
+            if (loop->next < loop->length)
             {
-
-                char* ori_input_dup = strdup(ori_input);
-                history[history_count] = strdup(ori_input_dup);
-                free(ori_input_dup); 
-                history_count++;
-
-                // history[history_count] = strdup(ori_input);
-                // history_count++;
+                char* word = loop->pool + loop->next;
+                set_shell_var(script->strings + command->text, word);
+                loop->next += strlen(word) + 1;
             }
             else
-            {
-                free(history[0]);
-                for (unsigned i = 1; i < history_capacity; i++)
-                history[i - 1] = history[i];
-                char* ori_input_dup = strdup(ori_input);
-                history[history_capacity-1] = strdup(ori_input_dup);
-                free(ori_input_dup); 
-                // history[history_capacity-1] = strdup(ori_input);
-            }
-            char** tokens;
-            tokens = split_input_to_token(ori_input);
-            
-            exec_fork(tokens);
-
-            // if (strcmp(new_input, command) != 0)
-            // {
-            //     restore_redirection();
-            // }
+            i = command->target;
         }
-        
-        // printf("input: %s\n", input);
-        // printf("command: %s\n", command);
-        // if (strcmp(new_input, command) != 0)
-        // {
-        //     // printf("here");
-        //     restore_redirection();
-        // }
-        
-        free(new_input);
-        free(ori_input);
+        else if (command->timed)
+        {
+            CommandTimer timer;
+            start_timer(&timer);
+            run_compiled_command(script, command);
+            report_timer(&timer);
+        }
+        else
+        run_compiled_command(script, command);
     }
-    last_exit_status = -1;
-    restore_redirection();
+    for (uint32_t j = 0; j <= script->command_count; j++)
+    free(loops[j].pool);
+    free(loops);
 }
 
-
+// Run a batch script from fd, parsed once, or straight from its cache
+// with WSH_CACHE set
+void run_script(const char* path, int fd)
+{
+    CompiledScript script;
+    struct stat statbuf;
+    char* cache_path = NULL;
+    if (script_cache && fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+    cache_path = script_cache_path(path);
+    if (cache_path == NULL || !load_script_cache(&script, cache_path, &statbuf))
+    {
+        compile_script(&script, fd);
+        if (cache_path != NULL)
+        write_script_cache(&script, cache_path, &statbuf);
+    }
+    free(cache_path);
+    run_compiled_script(&script);
+    free_script(&script);
+    exit(last_exit_status);
+}
 
 
 void free_memory(void)
 {
     // free(path_variable);
     free_shell_vars();
-    if (stdin_backup != -1) {
-        close(stdin_backup);  // Close stdin backup
-        stdin_backup = -1;  // Reset tag
-    }
-    if (stdout_backup != -1) {
-        close(stdout_backup);  // Close stdout backup
-        stdout_backup = -1;  // Reset tag
-    }
-    if (stderr_backup != -1) {
-        close(stderr_backup);  // Close stderr backup
-        stderr_backup = -1;  // Reset tag
-    }
+    clear_command_hash();
+    arena_free();
+    close_redirection();
     // Free memory used by history
-    for (unsigned i = 0; i < history_count; i++)
-        free(history[i]);
-    free(history);
+    drop_oldest_history(0);
+    if (history_map != NULL)
+        munmap(history_map, history_map_length);
+    history_map = NULL;
+    if (history_fd != -1)
+        close(history_fd);
+    history_fd = -1;
+    if (profile_fd != -1)
+        close(profile_fd);
+    profile_fd = -1;
+    forget_jobs();
+    free(jobs);
+    jobs = NULL;
+    job_slots = 0;
+    free_glob_cache();
 }
 
 int starts_with_special_prefix(char *str)
@@ -794,11 +3334,32 @@ int main(int argc, char* argv[])
 {
     // Prohibit stdout flush
     setvbuf(stdout, NULL, _IONBF, 0);
+    // Interactive shells keep their history in $HOME across sessions
+    if (argc == 1 && isatty(fileno(stdin)) && getenv("HOME") != NULL)
+    open_history_file(getenv("HOME"));
+    script_cache = getenv("WSH_CACHE") != NULL;
+    if (getenv("WSH_PROFILE") != NULL)
+    open_profile(getenv("WSH_PROFILE"));
     clearenv();
     setenv("PATH", "/bin", 1);
     struct stat statbuf;
     // path_variable = strdup(getenv("PATH"));
-    if (!(isatty(fileno(stdin)))) // If redirection?
+    if (argc == 4 && strcmp(argv[1], "-j") == 0) // wsh -j N script
+    {
+        char* end;
+        long jobs_limit = strtol(argv[2], &end, 10);
+        if (*end != '\0' || jobs_limit < 1 || jobs_limit > MAXIMUM_JOBS)
+        {
+            fprintf(stderr, "wsh: -j takes 1 to %d jobs\n", MAXIMUM_JOBS);
+            exit(-1);
+        }
+        parallel_jobs = jobs_limit;
+        argv += 2;
+        argc -= 2;
+    }
+    allocate_jobs(parallel_jobs);
+    // A batch file wins over whatever stdin is
+    if (argc == 1 && !(isatty(fileno(stdin)))) // If redirection?
     {
         if (fstat(fileno(stdin), &statbuf) == -1)
         {
@@ -847,10 +3408,14 @@ int main(int argc, char* argv[])
             {
                 loop_propmt("prompt");
             }
-            else
+            else if (parallel_jobs > 0)
             {
                 loop_propmt("no prompt"); // no wsh> prompt output
             }
+            else
+            {
+                run_script(argv[1], fileno(stdin));
+            }
             
             if (freopen("/dev/tty", "r", stdin) == NULL)
             {
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2, F_SETPIPE_SZ
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,24 +10,228 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <fnmatch.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 
-#define MAXIMUM_ARGS 10
-#define MAXIMUM_PATH 128
 #define MAX_PATH_LENGTH 128
 #define MAXIMUM_CWD 1024
 #define DEFAULT_HISTORY_SIZE 5
 #define MAXIMUM_HISTORY 100
 #define MAX_COMMAND_LEN 512
 #define MAX_PATHS 20
+#define COMMAND_HASH_SIZE 64
+#define MAXIMUM_PIPELINE 16
+#define PIPE_BUFFER_SIZE (1 << 20)
+#define JOB_SLOTS 64 // Job table size unless wsh -j N asks for more
+#define MAXIMUM_JOBS 4096 // Largest N for wsh -j N
+#define JOB_EVENTS 256 // Handled per epoll_wait
+#define JOB_POLL_MS 10
+#define HISTORY_FILE ".wsh_history"
+#define HISTORY_COMPACT_FACTOR 4 // The file is cut back to the ring at this many times its capacity
+#define READ_CHUNK (1 << 16)
+#define ARENA_BLOCK_SIZE 4096
+#define SCRIPT_CACHE_MAGIC "WSHC\0\0\0\5"
+#define COMMAND_SIMPLE 0 // argv with slots and a redirection
+#define COMMAND_LINE 1 // text runs through run_line()
+#define COMMAND_ARITHMETIC 2 // (( )): postfix items in the arguments
+#define ARITHMETIC_TARGET_WIDTH 10 // Digits of the item a && or || jumps to
+#define COMMAND_BRANCH 3 // To target if the last command failed
+#define COMMAND_JUMP 4 // To target
+#define COMMAND_FOR_INIT 5 // Start the for loop that follows
+#define COMMAND_FOR_NEXT 6 // Set variable text to the next word, or go to target
+#define BLOCK_IF 0
+#define BLOCK_ELSE 1
+#define BLOCK_WHILE 2
+#define BLOCK_FOR 3
+#define LS_GETDENTS_SIZE (1 << 20)
+#define WRITER_SIZE (1 << 16)
+#define LS_INSERTION_SORT 32
+#define CAPTURE_CHUNK (1 << 16)
+#define GLOB_CACHE_SIZE 16
+#define GLOB_RACY_NS 20000000L // Listings this close to the mtime are redone
+#define ARENA_ALIGN sizeof(char*) // Only strings and argv arrays live there
 
 
+// Shell variables live in an array in insertion order (what vars prints),
+// indexed by an open-addressing table of entry numbers + 1 (0 = empty).
+// Removed entries keep name NULL until the table is rebuilt.
 typedef struct ShellVariable \
 {
-    char name[MAX_COMMAND_LEN];
-    char value[MAX_COMMAND_LEN];
-    struct ShellVariable* next;
+    char* name;
+    char* value;
 } ShellVariable;
-typedef int (*built_in_func)(char** args);
+typedef struct ShellVariables \
+{
+    ShellVariable* entries;
+    unsigned count;
+    unsigned capacity;
+    unsigned removed;
+    unsigned* slots;
+    unsigned slot_count;
+} ShellVariables;
+// Buffered input: bytes [start, end) of buffer are read but not consumed
+typedef struct LineReader \
+{
+    int fd;
+    char* buffer;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    int eof;
+} LineReader;
+// One block of the command arena, its memory follows the header
+typedef struct ArenaBlock \
+{
+    struct ArenaBlock* previous;
+    size_t capacity;
+    size_t used;
+} ArenaBlock;
+// One line of a compiled batch script. Strings are offsets into the
+// script's pool; slots index the arguments that start with $.
+typedef struct CompiledCommand \
+{
+    uint32_t kind;
+    uint32_t text; // Command without redirection, whole line, or for variable
+    uint32_t target; // Of a branch or jump
+    uint32_t first_arg;
+    uint32_t argc;
+    uint32_t first_slot;
+    uint32_t slot_count;
+    int32_t built_in; // Index into built_ins, -1 if not a builtin
+    int32_t redirect_type; // As in open_redirection(), 0 if none
+    int32_t redirect_fd;
+    uint32_t redirect_path;
+    uint32_t timed; // 1 for time COMMAND
+} CompiledCommand;
+typedef struct CompiledScript \
+{
+    CompiledCommand* commands;
+    uint32_t* args;
+    uint32_t* slots;
+    char* strings;
+    uint32_t command_count;
+    uint32_t arg_count;
+    uint32_t slot_count;
+    uint32_t string_length;
+    char* memory; // Everything above, when read from a cache
+    // Only while compiling
+    uint32_t capacities[4];
+    struct CompiledBlock* blocks; // Open if and loops, innermost last
+    uint32_t block_count;
+    uint32_t block_capacity;
+} CompiledScript;
+// An if or loop being compiled. Its branch (or else's jump, or for's
+// next) is patched at the end; breaks chains its break jumps, index + 1.
+typedef struct CompiledBlock \
+{
+    uint32_t kind;
+    uint32_t head; // Where continue and done jump
+    uint32_t branch;
+    uint32_t breaks;
+} CompiledBlock;
+// The words of a running for loop, expanded when it starts, one after
+// another in a malloc'd pool
+typedef struct LoopWords \
+{
+    char* pool;
+    size_t length;
+    size_t capacity;
+    size_t next; // Offset of the next word
+} LoopWords;
+typedef struct ArithmeticParser \
+{
+    char** tokens;
+    size_t count;
+    size_t next;
+    CompiledScript* script;
+} ArithmeticParser;
+// A .wshc file is this header, then commands, args, slots and strings
+typedef struct ScriptCacheHeader \
+{
+    char magic[8];
+    int64_t mtime_sec; // Of the script it was compiled from
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t command_count;
+    uint32_t arg_count;
+    uint32_t slot_count;
+    uint32_t string_length;
+} ScriptCacheHeader;
+// Where time COMMAND started
+typedef struct CommandTimer \
+{
+    struct timespec start;
+    struct rusage self;
+    struct rusage children;
+} CommandTimer;
+// The sorted names in a directory, kept while its mtime is unchanged
+typedef struct GlobDirectory \
+{
+    char* path; // As globbed, NULL if the slot is free
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime; // tv_sec -1: listed too soon after a change
+    char* pool;
+    char** names;
+    size_t count;
+} GlobDirectory;
+// Where a command was found on PATH, remembered until PATH changes
+typedef struct CommandHash \
+{
+    char name[MAX_PATH_LENGTH];
+    char path[MAX_PATH_LENGTH];
+    unsigned hits;
+    struct CommandHash* next;
+} CommandHash;
+// A redirection parsed from the command line: one opened file and the
+// descriptors (-1 if unused) it replaces in the command
+typedef struct Redirection \
+{
+    int fd;
+    int targets[2];
+} Redirection;
+// A command or pipeline started with & (or by wsh -j N)
+// WSH_PROFILE: what one pipeline stage ran and when it started
+typedef struct StageTrace \
+{
+    char command[MAX_COMMAND_LEN];
+    struct timespec start;
+    struct timespec spawned;
+} StageTrace;
+typedef struct Job \
+{
+    int id; // 0 if the slot is free
+    pid_t pids[MAXIMUM_PIPELINE]; // 0 once reaped
+    int pidfds[MAXIMUM_PIPELINE]; // -1 once reaped, or if polled
+    int count;
+    int remaining; // Stages not reaped yet
+    int status; // Of the last stage: 0 or -1
+    unsigned long sequence; // Start order
+    int output; // wsh -j N: read end of its stdout, -1 at end of file
+    char* held; // Output waiting for the jobs started before it
+    size_t held_length;
+    size_t held_capacity;
+    StageTrace* traces; // WSH_PROFILE only: one per stage
+    char command[MAX_COMMAND_LEN];
+} Job;
+// Buffered output of a builtin
+typedef struct Writer \
+{
+    int fd;
+    size_t used;
+    char buffer[WRITER_SIZE];
+} Writer;
+typedef int (*built_in_func)(char** args, Writer* out);
 // const char* PATH="/bin/";
 struct built_in_command \
 {
@@ -34,15 +239,20 @@ struct built_in_command \
     built_in_func value;
 };
 
-ShellVariable* shell_vars = NULL;
+ShellVariables shell_vars = {NULL, 0, 0, 0, NULL, 0};
+ArenaBlock* command_arena = NULL;
+extern char** environ;
 
-int built_in_exit(char** args);
-int built_in_cd(char** args);
-int built_in_export(char** args);
-int built_in_local(char** args);
-int built_in_vars(char** args);
-int built_in_history(char** args);
-int built_in_ls(char** args);
+int built_in_exit(char** args, Writer* out);
+int built_in_cd(char** args, Writer* out);
+int built_in_export(char** args, Writer* out);
+int built_in_local(char** args, Writer* out);
+int built_in_vars(char** args, Writer* out);
+int built_in_history(char** args, Writer* out);
+int built_in_ls(char** args, Writer* out);
+int built_in_hash(char** args, Writer* out);
+int built_in_jobs(char** args, Writer* out);
+int built_in_wait(char** args, Writer* out);
 
 struct built_in_command built_ins[] = \
 {
@@ -52,19 +262,135 @@ struct built_in_command built_ins[] = \
     {"local", built_in_local},
     {"vars", built_in_vars},
     {"history", built_in_history},
-    {"ls", built_in_ls}
+    {"ls", built_in_ls},
+    {"hash", built_in_hash},
+    {"jobs", built_in_jobs},
+    {"wait", built_in_wait}
 };
 
-char* find_executable(char*);
-char* parse_and_execute(char *);
+char* find_executable(char*, int*);
+char* search_path(char*);
+CommandHash* remember_command(char*, char*);
+void forget_command(const char*);
+void clear_command_hash(void);
+char* scan_redirection(char *, int*, int*, char**);
+void open_redirection(int, int, const char*, Redirection*);
+void redirect_descriptors(const Redirection*);
+pid_t spawn_command(char*, char**, int, int, const Redirection*);
+pid_t spawn_executable(char**, int, int, const Redirection*);
+int wait_for_child(pid_t, int*, struct rusage*);
+long elapsed_us(const struct timespec*, const struct timespec*);
+long timeval_us(const struct timeval*);
+void open_profile(const char*);
+size_t quote_profile_command(char*, char**);
+void record_profile(char**, pid_t, int, const struct timespec*, const struct timespec*,
+                    const struct timespec*, const struct rusage*);
+void start_timer(CommandTimer*);
+void report_timer(const CommandTimer*);
+char* strip_time_prefix(char*);
+int built_in_index(const char*);
+built_in_func find_built_in(const char*);
+int run_built_in(built_in_func, char**, int);
+pid_t start_stage(char*, int, int, int);
+void run_pipeline(char*);
+void add_history(char*);
+int launch_pipeline(char*, pid_t*, int, StageTrace*);
+void record_stage_profile(const StageTrace*, pid_t, int, const struct rusage*);
+int job_descriptor(Job*, int, int);
+int job_finished(Job*);
+void record_stage_exit(Job*, int, int);
+void reap_stage(Job*, int);
+void write_job_output(const char*, size_t);
+Job* next_output_job(void);
+void advance_output(void);
+void read_job_output(Job*);
+int process_job_events(int);
+int running_jobs(void);
+void wait_for_any_job(void);
+int wait_job(Job*);
+int wait_all_jobs(int);
+void allocate_jobs(int);
+void forget_jobs(void);
+void run_background(char*);
+int strip_background(char*);
+int starts_with_built_in(char*);
+char* history_entry(unsigned);
+void drop_oldest_history(unsigned);
+void append_history(char*);
+void open_history_file(const char*);
+void load_history(void);
+void compact_history_file(void);
+void* arena_alloc(size_t);
+char* arena_copy(const char*, size_t);
+void* arena_grow(void*, size_t, size_t);
+void arena_reset(void);
+void arena_free(void);
+char* read_line(LineReader*);
+char* substitution_end(char*);
+char* find_outside_substitution(char*, const char*);
+char* capture_command(char*, size_t*);
+char* substitute_commands(char*);
 char* replace_vars_in_token(char*);
+char* next_token(char**);
+int glob_token(char*);
+int list_glob_directory(GlobDirectory*, const char*);
+GlobDirectory* glob_directory(const char*);
+void free_glob_cache(void);
+char** append_arg(char**, size_t*, size_t*, char*);
+char** append_glob(char**, size_t*, size_t*, char*);
 char** split_input_to_token(char*);
+void run_line(char*);
 int loop_propmt(char*);
+void* reserve_items(void*, uint32_t*, size_t, size_t, size_t);
+uint32_t add_script_string(CompiledScript*, const char*, size_t);
+void add_script_arg(CompiledScript*, const char*, int);
+uint32_t add_script_command(CompiledScript*, uint32_t);
+void script_syntax_error(void);
+void compile_command(CompiledScript*, char*);
+char** lex_arithmetic(char*, size_t*);
+const char* arithmetic_peek(ArithmeticParser*, size_t);
+int arithmetic_accept(ArithmeticParser*, const char*);
+void compile_increment(ArithmeticParser*, const char*, const char*, int);
+int is_arithmetic_name(const char*);
+void parse_arithmetic_unary(ArithmeticParser*);
+void parse_arithmetic_binary(ArithmeticParser*, int);
+void parse_arithmetic_assignment(ArithmeticParser*);
+void compile_arithmetic(CompiledScript*, char*);
+void compile_condition(CompiledScript*, char*);
+void strip_block_keyword(char*, const char*);
+CompiledBlock* push_block(CompiledScript*, uint32_t, uint32_t, uint32_t);
+CompiledBlock* top_block(CompiledScript*, uint32_t, uint32_t);
+int is_control_line(char*);
+void compile_line(CompiledScript*, char*);
+void compile_script(CompiledScript*, int);
+char* script_cache_path(const char*);
+int check_script(const CompiledScript*);
+int load_script_cache(CompiledScript*, const char*, const struct stat*);
+int write_all(int, const void*, size_t);
+void write_script_cache(const CompiledScript*, const char*, const struct stat*);
+void free_script(CompiledScript*);
+long arithmetic_value(const char*);
+void assign_arithmetic(const char*, long);
+int apply_arithmetic(const char*, long, long, long*);
+int evaluate_arithmetic(const CompiledScript*, const CompiledCommand*);
+void run_compiled_command(const CompiledScript*, const CompiledCommand*);
+void expand_loop_words(const CompiledScript*, const CompiledCommand*, LoopWords*);
+void run_compiled_script(const CompiledScript*);
+void run_script(const char*, int);
 void exec_fork(char**);
 int determine_annotation(char*);
 void free_memory(void);
 int set_shell_var(char*, char*);
+ShellVariable* get_shell_var(const char*, size_t);
+unsigned hash_var_name(const char*, size_t);
+unsigned find_var_slot(const char*, size_t);
+void rebuild_shell_vars(unsigned);
 void free_shell_vars(void);
-void restore_redirection(void);
+int built_in_output_fd(const Redirection*);
+void writer_flush(Writer*);
+void writer_put(Writer*, const char*, size_t);
+void writer_printf(Writer*, const char*, ...);
+void close_redirection(void);
 int starts_with_special_prefix(char*);
-int compare(const void *, const void *);
+int hidden_name(const char*);
+void sort_names(char**, size_t, size_t, char**);